@@ -10,13 +10,27 @@
 #include <xsd/m2m/Names.hpp>
 
 #include <thread>
+#include <cctype>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
 #include <fstream>
+#include <memory>
 
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "meter.h"
+#include "multimeter.h"
+#include "baseline.h"
+#include "compliance.h"
+#include "perf.h"
+#include "history.h"
+#include "retained.h"
+#include "reorder.h"
+#include "uplink.h"
 
 using namespace std::chrono;
 using namespace nlohmann;
@@ -33,47 +47,140 @@ const std::string APP_NAME = "com.grid-net.meterdemo";          // Name of the I
 
 const aos::LogLevel LOG_LEVEL = aos::LogLevel::LOG_INFO;        // Maximum logging level; set to LOG_DEBUG for more logread detail
 const std::string IN_CSE = "/PN_CSE";                           // Absolute path to the IN-CSE
-const std::string IN_AE_RESOURCE_NAME = "";                     // Report content instance name; empty string for automatic names
+const std::string IN_AE_RESOURCE_NAME = "";                     // Name of other content instances; empty string for automatic
 const std::string APP_PATH = "./" + APP_RESOURCE;               // Relative path of our local configuration container
 const int MAX_INSTANCE_AGE_S = 900;                             // Duration to create containers for
 const int BACKOFF_DEFAULT_S = 30;
 const int SAMPLE_PERIOD_DEFAULT = 1;                            // Time between information requests from the mtrsvc, in seconds
+const int SUMMATION_PERIOD_DEFAULT = 60;                        // Time between summation register reads, in seconds; 0 to disable
+const RegisterField SUMMATION_REGISTERS[] = { { "deliveredWh", 1e9 },       // SummationData register fields to accumulate, and
+                                              { "receivedWh", 1e9 },        // each register's modulus; NOTE Set to match the
+                                              { "deliveredVarh", 1e9 },     // meter's register map.  Other fields are ignored
+                                              { "receivedVarh", 1e9 } };
 const int REPORT_PERIOD_DEFAULT = 3600;                         // Time between meter information reports to the IN-AE, in seconds
 const bool SPOOF_METER = false;                                 // Set to true if using metersim
+const bool MULTI_METER = false;                                 // Set to true to report on each metering point separately
+const std::string METER_ID_KEY = "mtrid";                       // Meter read attribute identifying the metering point
+const int UPLOAD_BATCH_MAX = 8;                                 // Maximum number of queued summaries to send in one payload
+const bool SEQUENCE_NAMES = true;                               // Name summaries by their sequence numbers, if persisted
+const uint32_t UPLOAD_ATTEMPTS_MAX = 8;                         // Attempts to send a summary before leaving it to be resent
+const int UPLOAD_RETRY_MAX_S = 64;                              // Maximum delay before retrying a failed summary upload
+const bool REPORT_BY_EXCEPTION_DEFAULT = false;                 // Set to true to send heartbeats in place of unremarkable summaries
+const bool AGGREGATOR = false;                                  // Set to true to merge peer summaries and report only the aggregate
+const std::string PEER_RESOURCE = APP_RESOURCE + "-peers";      // Name of our local container receiving peer summaries
+const std::string PEER_PATH = "./" + PEER_RESOURCE;             // Relative path of our local peer summary container
+const std::string AGGREGATE_METER_ID = "aggregate";             // Meter ID reported for the aggregate summary
+const std::string HISTORY_FILE = "history.dat";                 // On-device store of per-minute averages; empty string to disable
+const int QUERY_RESOLUTION_DEFAULT = 60;                        // Interval of the averages returned by a history query, in seconds
+const int QUERY_QUEUE_MAX = 4;                                  // Maximum number of history queries awaiting an answer
+const size_t QUERY_RESPONSE_MAX = 16384;                        // Maximum size of the rows in each history query response, in bytes
+const std::string RETAINED_FILE = "retained.dat";               // Persistent copy of recent summaries; empty string for RAM only
+const char* const CHANNEL_NAMES[CHANNELS] = { "v1", "i1", "p1", "q1", "pf1",   // Measured channels, in Sample::channel() order
+                                              "v2", "i2", "p2", "q2", "pf2",
+                                              "v3", "i3", "p3", "q3", "pf3",
+                                              "f" };
 
 // Member objects
 m2m::AppEntity appEntity;                                       // OneM2M Application Entity (AE) object
 Report report;                                                  // mtrsvc sample accumulator and reporter
+std::unique_ptr<MeterTable> meterTable;                         // Per-meter sample accumulators and reporters, if MULTI_METER
+SampleSummary aggregate;                                        // Merge of our own and peer summaries, if AGGREGATOR
+Baseline baseline;                                              // Hour-of-day baselines of our own summaries
+Compliance compliance;                                          // Weekly EN 50160 compliance of our own supply
+ReorderBuffer reorderBuffer;                                    // Restores the read order of our own samples, dropping duplicates
+History::Store history;                                         // Compressed per-minute history of our own samples
+History::Downsampler downsampler;
+SummaryRing retainedSummaries;                                  // Compact copies of the most recent summaries sent
+#ifdef TIME_OF_USE
+TouCalendar touCalendar;                                        // Time-of-use periods to split the statistics by, if configured
+#endif
+bool reportByException = REPORT_BY_EXCEPTION_DEFAULT;
 int reportPeriod = REPORT_PERIOD_DEFAULT;
 milliseconds reportTime = milliseconds(0);                      // Scheduled time to transmit the next report
 
-std::queue<SampleSummary> reportQueue;                          // Queue to pass report summaries to the report summary thread
+// Summary queued to be sent, and when.
+struct QueuedSummary
+{
+    SampleSummary summary;
+    steady_clock::time_point queued;
+    uint32_t attempts;                                          // Failed attempts to send it; NOTE Not merged once attempted
+    steady_clock::time_point notBefore;                         // Not to be sent before, to delay the retry of a failed attempt
+};
+
+// Upload handed to the report queue thread in the bulk lane by the history query thread, which waits for it to be sent.
+struct BulkUpload
+{
+    ordered_json json;
+    steady_clock::time_point queued;
+    bool pending;                                               // Awaiting its turn to be sent
+    bool done;                                                  // Sent, or failed to be sent
+    bool success;
+};
+
+std::deque<QueuedSummary> reportQueue[LANE_BULK];               // Per summary lane, queue of summaries for the report thread
+BulkUpload bulkUpload;
+std::mutex reportQueueMutex;                                    // Guards the above, and the upload scheduler's weights
+std::condition_variable reportQueueCondition;                   // Signalled when an upload is queued, or a bulk upload is done
+UploadScheduler uploadScheduler;                                // Chooses the lane of each upload; used by the report thread
+UplinkBudget uplinkBudget;                                      // Governs the bytes sent against a data budget, if configured
+Backpressure backpressure;                                      // Lengthens the report period while the backlog is not draining
+
+// History range query, or request to resend retained summaries, answered by the history query thread.
+struct HistoryQuery
+{
+    uint32_t from;                                              // Time range, in seconds since the epoch, or sequence number range
+    uint32_t to;
+    uint32_t resolution;                                        // Interval to average over, in seconds, if not retained
+    bool retained;                                              // Resend the retained summaries in the sequence number range
+};
+
+std::queue<HistoryQuery> queryQueue;                            // Queue to pass history queries to the history query thread
+std::mutex queryQueueMutex;
 
 std::string containerPath;                                      // Path to IN-AE's container that we will create reports in
 
 // Function prototypes
 void spawn_threads();
 void report_queue_thread();
+void history_query_thread();
 
 void spoofSample(Sample& sample);
 std::string singleQuoteToDoubleQuote(const std::string& s);
 
 bool create_subscription(const std::string& parentPath, const std::string& resourceName);
-bool create_meter_read_policy();
+bool create_meter_read_policy(const std::string& readingType, const std::string& resourceName, const int recurrencePeriod);
 bool discover_in_ae(const std::string& csePath, const std::string& appName, std::string& path);
 bool discover_container(const std::string& parentPath, std::string& containerPath);
 bool create_container(const std::string& parentPath, const std::string& resourceName, const int maxInstanceAge);
 bool discover_content_instances(const std::string& parentPath);
 bool create_content_instance(const std::string& parentPath, const std::string& resourceName, const SampleSummary& sampleSummary);
+bool create_content_instance(const std::string& parentPath, const std::string& resourceName,
+                             const std::vector<SampleSummary>& batch);
+bool create_content_instance(const std::string& parentPath, const std::string& resourceName, ordered_json& json,
+                             bool appendStats = true);
+bool uploadBulk(ordered_json& json);
 bool delete_content_instance(const std::string& path);
+void sendRequest(m2m::Request& request, size_t contentBytes = 0);
+std::string summaryResourceName(const std::vector<SampleSummary>& batch);
 void notificationCallback(m2m::Notification notification);
+bool parseConfig(const nlohmann::json& json);
 void parseReportInterval(const int seconds);
-void parseMeterSvcData(const xsd::mtrsvc::MeterSvcData& meterSvcData);
+void parseHistoryQuery(const nlohmann::json& query);
+void parseResend(const nlohmann::json& resend);
+void answerRetainedQuery(const HistoryQuery& query);
+void addMissing(ordered_json& missing, uint32_t from, uint32_t to);
+void queueSummary(const SampleSummary& sampleSummary, Lane lane = LANE_REPORT);
+void mergeBacklog(std::deque<QueuedSummary>& queue);
+size_t queuedSummaries();
+void parsePeerSummary(const nlohmann::json& json);
+void reportSummary(const SampleSummary& sampleSummary, Lane lane = LANE_REPORT);
+void parseMeterSvcData(const xsd::mtrsvc::MeterSvcData& meterSvcData, const std::string& meterId);
+void accumulateSample(const Sample& sample);
 
 // Helper functions
 [[noreturn]] void usage(const char *prog)
 {
-    fprintf(stderr, "Usage %s [-d] [-p <POA-URI>|-a <IPADDR[:PORT]>] [CSE-URI]\n", prog);
+    fprintf(stderr, "Usage %s [-d] [-P] [-p <POA-URI>|-a <IPADDR[:PORT]>] [CSE-URI]\n", prog);
     exit(EXIT_FAILURE);
 }
 
@@ -87,13 +194,21 @@ int main(int argc, char *argv[])
     aos::setLogLevel(LOG_LEVEL);
 
     int opt;
-    while ((opt = getopt(argc, argv, "dp:a:")) != -1)
+    while ((opt = getopt(argc, argv, "dPp:a:")) != -1)
     {
         switch (opt)
         {
         case 'd':
             aos::setLogLevel(aos::LogLevel::LOG_DEBUG);
             break;
+#ifdef PERF_COUNTERS
+        case 'P':
+            if (Perf::enable())
+                logInfo("Profiling with hardware performance counters");
+            else
+                logWarn("Hardware performance counters unavailable; profiling call counts and times only");
+            break;
+#endif
         case 'p':
             poaUri = optarg;
             break;
@@ -128,6 +243,25 @@ int main(int argc, char *argv[])
         appEntity.setPoaAddr(poaAddr);
     }
 
+    if (!HISTORY_FILE.empty() && !history.open(HISTORY_FILE))
+        logWarn("Unable to open history store " << HISTORY_FILE << "; history disabled");
+    if (!RETAINED_FILE.empty() && !retainedSummaries.open(RETAINED_FILE))
+        logWarn("Unable to open retained summaries file " << RETAINED_FILE << "; retaining summaries in RAM only");
+
+    // Allocate the meter table only if used, as it holds a Report for every slot.
+    if (MULTI_METER)
+        meterTable.reset(new MeterTable);
+
+    report.setExpectedPeriod(milliseconds(SAMPLE_PERIOD_DEFAULT * 1000));
+    if (meterTable)
+        meterTable->setExpectedPeriod(milliseconds(SAMPLE_PERIOD_DEFAULT * 1000));
+    reorderBuffer.setPeriod(milliseconds(SAMPLE_PERIOD_DEFAULT * 1000));
+#ifdef TIME_OF_USE
+    report.setCalendar(&touCalendar);
+    if (meterTable)
+        meterTable->setCalendar(&touCalendar);
+#endif
+
     spawn_threads();
 
     while (true)
@@ -158,13 +292,20 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        if (!create_meter_read_policy())
+        if (!create_meter_read_policy("powerQuality", "metersvc-" + APP_RESOURCE, SAMPLE_PERIOD_DEFAULT))
         {
             logError("meter read policy creation failed");
             std::this_thread::sleep_for(seconds{BACKOFF_DEFAULT_S});
             continue;
         }
 
+        // Summation registers are an optional extra; carry on without them if the meter does not support them.
+        if (SUMMATION_PERIOD_DEFAULT > 0
+            && !create_meter_read_policy("summations", "metersvc-" + APP_RESOURCE + "-sum", SUMMATION_PERIOD_DEFAULT))
+        {
+            logWarn("summation read policy creation failed; not reporting summations");
+        }
+
         // Example: Discover the MN-CSE's containers, to a maximum depth of 2.
 //        std::string dummy;
 //        if (!discover_container(".", dummy))
@@ -193,6 +334,24 @@ int main(int argc, char *argv[])
             continue;
         }
 
+        // Create and subscribe to the local container in which peer devices create their summaries.
+        if (AGGREGATOR)
+        {
+            if (!create_container(".", PEER_RESOURCE, MAX_INSTANCE_AGE_S))
+            {
+                logError("Peer container creation failed");
+                std::this_thread::sleep_for(seconds{BACKOFF_DEFAULT_S});
+                continue;
+            }
+
+            if (!create_subscription(PEER_PATH, APP_RESOURCE + "-sub-02"))
+            {
+                logError("Peer subscription creation failed");
+                std::this_thread::sleep_for(seconds{BACKOFF_DEFAULT_S});
+                continue;
+            }
+        }
+
         std::string aePath;
         if (!discover_in_ae(IN_CSE, APP_NAME, aePath))
         {
@@ -221,24 +380,283 @@ void spawn_threads()
     std::thread meter_summary_publishing_thread(report_queue_thread);
     meter_summary_publishing_thread.detach();
     logDebug("Spawned meter summary publishing thread");
+
+    logDebug("Spawning history query thread ...");
+    std::thread history_query_answering_thread(history_query_thread);
+    history_query_answering_thread.detach();
+    logDebug("Spawned history query thread");
 }
 
-// Thread to report sample summaries passed in via reportQueue.
+// Thread to send all uploads: the sample summaries passed in via the urgent and report lanes' queues, and the bulk uploads
+// passed in by the history query thread, in the order chosen by the upload scheduler.  Where several summaries are waiting in
+// a lane, as is the case when reporting on multiple meters, up to UPLOAD_BATCH_MAX of them are sent together in a single
+// content instance.  A batch that fails to be sent is put back at the front of its lane and retried as the same batch, under
+// the same name, after a delay doubling with each attempt, until UPLOAD_ATTEMPTS_MAX attempts have failed; the lane is passed
+// over until then, so the other lanes are not held up by the delay.
 void report_queue_thread()
 {
+    std::vector<SampleSummary> batch;
+    batch.reserve(UPLOAD_BATCH_MAX);
+
     while (true)
     {
-        if (reportQueue.empty())
+        int lane;
+        steady_clock::time_point queued;
+        uint32_t attempts = 0;
+        ordered_json bulk;
+        {
+            std::unique_lock<std::mutex> lock(reportQueueMutex);
+            bool waiting[LANES];
+            reportQueueCondition.wait_for(lock, seconds{1}, [&waiting]()
+            {
+                // Lanes held back by the uplink budget or a retry delay are rechecked each second.
+                time_point<system_clock> now = system_clock::now();
+                steady_clock::time_point nowSteady = steady_clock::now();
+                auto due = [nowSteady](int lane)
+                {
+                    return !reportQueue[lane].empty() && reportQueue[lane].front().notBefore <= nowSteady;
+                };
+                waiting[LANE_URGENT] = due(LANE_URGENT);
+                waiting[LANE_REPORT] = due(LANE_REPORT) && uplinkBudget.allows(LANE_REPORT, now);
+                waiting[LANE_BULK] = bulkUpload.pending && uplinkBudget.allows(LANE_BULK, now);
+                return waiting[LANE_URGENT] || waiting[LANE_REPORT] || waiting[LANE_BULK];
+            });
+
+            lane = uploadScheduler.next(waiting);
+            if (lane == LANE_BULK)
+            {
+                bulk = std::move(bulkUpload.json);
+                queued = bulkUpload.queued;
+                bulkUpload.pending = false;
+            }
+            else if (lane >= 0)
+            {
+                std::deque<QueuedSummary>& queue = reportQueue[lane];
+                queued = queue.front().queued;
+                attempts = queue.front().attempts;
+                while (!queue.empty() && batch.size() < UPLOAD_BATCH_MAX && queue.front().attempts == attempts)
+                {
+                    batch.push_back(queue.front().summary);
+                    queue.pop_front();
+                }
+            }
+        }
+
+        if (lane < 0)
+            continue;
+
+        // Step down to brief summaries while the uplink budget is running low.
+        if (lane != LANE_BULK && uplinkBudget.level(system_clock::now()) >= LEVEL_BRIEF)
+        {
+            for (SampleSummary& sampleSummary : batch)
+                sampleSummary.brief = true;
+        }
+
+        bool success;
+        if (lane == LANE_BULK)
+        {
+            success = create_content_instance(containerPath, IN_AE_RESOURCE_NAME, bulk, false);
+        }
+        else if (batch.size() == 1)
+        {
+            logDebug("Sending summary of " << batch[0].count << " samples");
+            success = create_content_instance(containerPath, summaryResourceName(batch), batch[0]);
+        }
+        else
+        {
+            logDebug("Sending batch of " << batch.size() << " summaries");
+            success = create_content_instance(containerPath, summaryResourceName(batch), batch);
+        }
+        uploadScheduler.sent(lane, duration_cast<milliseconds>(steady_clock::now() - queued), success);
+
+        if (lane == LANE_BULK)
+        {
+            std::lock_guard<std::mutex> lock(reportQueueMutex);
+            bulkUpload.done = true;
+            bulkUpload.success = success;
+            reportQueueCondition.notify_all();
+        }
+        else if (success)
+        {
+            backpressure.delivered(batch.size());
+        }
+        else if (++attempts < UPLOAD_ATTEMPTS_MAX)
+        {
+            int delay = std::min(1 << attempts, UPLOAD_RETRY_MAX_S);
+            logWarn("Failed to send summary " << batch.front().sequence << "; retrying in " << delay << " s");
+            steady_clock::time_point notBefore = steady_clock::now() + seconds{delay};
+            std::lock_guard<std::mutex> lock(reportQueueMutex);
+            for (auto it = batch.rbegin(); it != batch.rend(); ++it)
+                reportQueue[lane].push_front({ *it, queued, attempts, notBefore });
+        }
+        else
+        {
+            logError("Failed to send summary " << batch.front().sequence << " after " << attempts
+                     << " attempts; dropped, but retained to be resent");
+        }
+
+        batch.clear();
+    }
+}
+
+// Hand the given JSON object to the report queue thread to be sent in the bulk lane, and wait until it has been sent.
+// Returns false if it could not be sent.
+// NOTE Only to be called from the history query thread, as there is room for only one bulk upload at a time.
+bool uploadBulk(ordered_json& json)
+{
+    std::unique_lock<std::mutex> lock(reportQueueMutex);
+    bulkUpload.json = std::move(json);
+    bulkUpload.queued = steady_clock::now();
+    bulkUpload.pending = true;
+    bulkUpload.done = false;
+    reportQueueCondition.notify_all();
+    reportQueueCondition.wait(lock, []() { return bulkUpload.done; });
+
+    return bulkUpload.success;
+}
+
+// Resend the retained summaries within the query's sequence number range, as a stream of content instances each holding as many
+// summaries as fit in QUERY_RESPONSE_MAX bytes.  Summaries that are no longer, or not yet, retained are listed as missing, as
+// ranges [<from>, <to>].  Only the part of the range within the ring is walked, so the parts beyond it are each listed as a
+// single range, however long.
+void answerRetainedQuery(const HistoryQuery& query)
+{
+    uint32_t first = retainedSummaries.first();
+    uint32_t from = std::max(query.from, first);
+    uint32_t to = std::min(query.to, retainedSummaries.lastSequence());
+    bool retained = first > 0 && from <= to;                    // Some of the range may still be retained
+
+    logInfo("Resending retained summaries " << query.from << " to " << query.to);
+    uint32_t sequence = from;
+    uint32_t part = 0;
+    uint32_t resent = 0;
+    bool more;
+
+    do
+    {
+        ordered_json json;
+        json["resend"] = { { "from", query.from }, { "to", query.to } };
+        json["part"] = part;
+        json["rs"] = ordered_json::array();
+        json["missing"] = ordered_json::array();
+        if (part++ == 0 && (!retained || query.from < from))
+            addMissing(json["missing"], query.from, retained ? from - 1 : query.to);
+
+        size_t size = 0;
+        for (; retained && sequence <= to && sequence != 0 && size < QUERY_RESPONSE_MAX; sequence++)
+        {
+            RetainedSummary summary;
+            if (retainedSummaries.get(sequence, summary))
+            {
+                ordered_json tmp;
+                summary.json(tmp);
+                size += tmp.dump().length() + 1;
+                json["rs"].push_back(tmp);
+                resent++;
+            }
+            else
+            {
+                addMissing(json["missing"], sequence, sequence);
+                size += 24;
+            }
+        }
+        more = retained && sequence <= to && sequence != 0;
+        if (!more && retained && query.to > to)
+            addMissing(json["missing"], to + 1, query.to);
+        json["more"] = more;
+
+        if (!uploadBulk(json))
+        {
+            logError("Failed to resend retained summaries; request abandoned");
+            return;
+        }
+    }
+    while (more);
+
+    logInfo("Resent " << resent << " retained summaries in " << part << " parts");
+}
+
+// Add the given range of sequence numbers to a JSON array of missing ranges, extending the last range if contiguous with it.
+void addMissing(ordered_json& missing, uint32_t from, uint32_t to)
+{
+    if (!missing.empty() && missing.back()[1].get<uint32_t>() + 1 == from)
+        missing.back()[1] = to;
+    else
+        missing.push_back({ from, to });
+}
+
+// Answer each queued history query with a stream of content instances, each holding as many rows of averages as fit in
+// QUERY_RESPONSE_MAX bytes.  The history is read directly from its mapping, concurrently with the appending of new samples,
+// and each part is sent in the bulk lane, so that a long query does not hold up the accumulation of samples or the sending of
+// reports.
+void history_query_thread()
+{
+    while (true)
+    {
+        HistoryQuery query;
+        {
+            std::lock_guard<std::mutex> lock(queryQueueMutex);
+            if (!queryQueue.empty())
+            {
+                query = queryQueue.front();
+                queryQueue.pop();
+            }
+            else
+            {
+                query.resolution = 0;
+            }
+        }
+
+        if (query.resolution == 0)
         {
             std::this_thread::sleep_for(seconds{1});
             continue;
         }
 
-        auto summary = reportQueue.front();
-        reportQueue.pop();
-        logDebug("Sending summary of " << summary.count << " samples");
-        if (!create_content_instance(containerPath, IN_AE_RESOURCE_NAME, summary))
-            logError("Failed to send summary");
+        if (query.retained)
+        {
+            answerRetainedQuery(query);
+            continue;
+        }
+
+        logInfo("Answering history query from " << query.from << " to " << query.to << " at " << query.resolution << " s");
+        History::Resampler resampler(history, query.from, query.to, query.resolution);
+        History::Record record;
+        bool more = resampler.next(record);
+        uint32_t part = 0;
+        uint32_t rows = 0;
+
+        // Always send at least one part, so that an empty range is answered too.
+        do
+        {
+            ordered_json json;
+            json["query"] = { { "from", query.from }, { "to", query.to }, { "res", query.resolution } };
+            json["part"] = part++;
+            json["ch"] = CHANNEL_NAMES;
+            json["d"] = ordered_json::array();
+
+            size_t size = 0;
+            while (more && size < QUERY_RESPONSE_MAX)
+            {
+                ordered_json row = ordered_json::array({ record.ts });
+                for (uint32_t c = 0; c < CHANNELS; c++)
+                    row.push_back(History::quantise(c, record.value[c]));
+                size += row.dump().length() + 1;
+                json["d"].push_back(row);
+                rows++;
+                more = resampler.next(record);
+            }
+            json["more"] = more;
+
+            if (!uploadBulk(json))
+            {
+                logError("Failed to send history query response; query abandoned");
+                break;
+            }
+        }
+        while (more);
+
+        logInfo("Answered history query with " << rows << " rows in " << part << " parts");
     }
 }
 
@@ -292,7 +710,7 @@ bool create_subscription(const std::string& parentPath, const std::string& resou
     request.req->resourceType = xsd::m2m::ResourceType::subscription;
     request.req->primitiveContent = xsd::toAnyNamed(subscription);
 
-    appEntity.sendRequest(request);
+    sendRequest(request);
     auto response = appEntity.getResponse(request);
 
     logInfo("Subscription: " << toString(response->responseStatusCode));
@@ -301,20 +719,20 @@ bool create_subscription(const std::string& parentPath, const std::string& resou
             || response->responseStatusCode == xsd::m2m::ResponseStatusCode::CONFLICT);
 }
 
-// Create the default mtrsvc read policy.
+// Create an mtrsvc read policy of the given name, to read the given type of data every recurrencePeriod seconds.
 // NOTE This persists until the device is restarted, even if the app is stopped.
-bool create_meter_read_policy()
+bool create_meter_read_policy(const std::string& readingType, const std::string& resourceName, const int recurrencePeriod)
 {
     xsd::mtrsvc::ScheduleInterval scheduleInterval;
     scheduleInterval.end = nullptr;
     scheduleInterval.start = "2020-06-19T00:00:00";
 
     xsd::mtrsvc::TimeSchedule timeSchedule;
-    timeSchedule.recurrencePeriod = SAMPLE_PERIOD_DEFAULT;
+    timeSchedule.recurrencePeriod = recurrencePeriod;
     timeSchedule.scheduleInterval = std::move(scheduleInterval);
 
     xsd::mtrsvc::MeterReadSchedule meterReadSchedule;
-    meterReadSchedule.readingType = "powerQuality";
+    meterReadSchedule.readingType = readingType;
     meterReadSchedule.timeSchedule = std::move(timeSchedule);
 
     xsd::mtrsvc::MeterServicePolicy meterServicePolicy;
@@ -323,14 +741,14 @@ bool create_meter_read_policy()
     xsd::m2m::ContentInstance policyInst = xsd::m2m::ContentInstance::Create();
     policyInst.content = xsd::toAnyTypeUnnamed(meterServicePolicy);
 
-    policyInst.resourceName = "metersvc-" + APP_RESOURCE;
+    policyInst.resourceName = resourceName;
 
     m2m::Request request = appEntity.newRequest(xsd::m2m::Operation::Create, m2m::To{"./metersvc/policies"});
     request.req->resultContent = xsd::m2m::ResultContent::Nothing;
     request.req->resourceType = xsd::m2m::ResourceType::contentInstance;
     request.req->primitiveContent = xsd::toAnyNamed(policyInst);
 
-    appEntity.sendRequest(request);
+    sendRequest(request);
     auto response = appEntity.getResponse(request);
 
     logInfo("Policy creation: " << toString(response->responseStatusCode));
@@ -361,7 +779,7 @@ bool discover_in_ae(const std::string& csePath, const std::string& appName, std:
 
     request.req->filterCriteria = std::move(fc);
 
-    appEntity.sendRequest(request);
+    sendRequest(request);
     auto response = appEntity.getResponse(request);
 
     if (response->responseStatusCode != xsd::m2m::ResponseStatusCode::OK)
@@ -409,7 +827,7 @@ bool discover_container(const std::string& parentPath, std::string& containerPat
 
     request.req->filterCriteria = std::move(fc);
 
-    appEntity.sendRequest(request);
+    sendRequest(request);
     auto response = appEntity.getResponse(request);
 
     if (response->responseStatusCode != xsd::m2m::ResponseStatusCode::OK)
@@ -461,7 +879,7 @@ bool create_container(const std::string& parentPath, const std::string& resource
 
     request.req->primitiveContent = xsd::toAnyNamed(cnt);
 
-    appEntity.sendRequest(request);
+    sendRequest(request);
     auto response = appEntity.getResponse(request);
 
     if (response->responseStatusCode != xsd::m2m::ResponseStatusCode::CREATED
@@ -497,7 +915,7 @@ bool discover_content_instances(const std::string& parentPath)
 
     request.req->filterCriteria = std::move(fc);
 
-    appEntity.sendRequest(request);
+    sendRequest(request);
     auto response = appEntity.getResponse(request);
 
     if (response->responseStatusCode != xsd::m2m::ResponseStatusCode::OK)
@@ -512,8 +930,70 @@ bool discover_content_instances(const std::string& parentPath)
     return true;
 }
 
+// Return the name to create the content instance holding the given batch of summaries under, made from the AE's ID, the
+// sequence numbers of the first and last summaries and the start time of the first in seconds since the epoch, e.g.
+// "Cmetersvc-smpl-s120-127-t1700000000".  Since the name is unique to them, a retry of a request whose response was lost finds
+// the content instance already created.  The start time keeps it unique should a sequence number be reused, as after a power
+// cut before retained.dat was written back, or once retained.dat is reset.  An empty name, for the CSE to allocate one, is
+// returned if the sequence numbers are not persisted, as they would be reused after every restart.
+std::string summaryResourceName(const std::vector<SampleSummary>& batch)
+{
+    if (!SEQUENCE_NAMES || !retainedSummaries.persistent() || batch.front().sequence == 0)
+        return IN_AE_RESOURCE_NAME;
+
+    std::string aeId = appEntity.getResourceId();
+    std::string name = aeId.substr(aeId.find_last_of('/') + 1);
+    for (char& c : name)
+    {
+        if (!isalnum((unsigned char)c) && c != '-' && c != '_')
+            c = '-';
+    }
+    name += "-s" + std::to_string(batch.front().sequence);
+    if (batch.back().sequence != batch.front().sequence)
+        name += "-" + std::to_string(batch.back().sequence);
+    name += "-t" + std::to_string(duration_cast<seconds>(batch.front().tsStart.time_since_epoch()).count());
+
+    return name;
+}
+
 // Create a SampleSummary content instance of the given name in the given parent path.
 bool create_content_instance(const std::string& parentPath, const std::string& resourceName, const SampleSummary& sampleSummary)
+{
+    ordered_json json;
+    {
+        PERF_SCOPE(Perf::Stage::Json);
+        sampleSummary.json(json);
+    }
+
+    return create_content_instance(parentPath, resourceName, json);
+}
+
+// Create a content instance of the given name in the given parent path, holding a batch of SampleSummaries as {"b":[...]}.
+bool create_content_instance(const std::string& parentPath, const std::string& resourceName,
+                             const std::vector<SampleSummary>& batch)
+{
+    ordered_json json;
+    {
+        PERF_SCOPE(Perf::Stage::Json);
+        json["b"] = json::array();
+        ordered_json tmp;
+        for (const SampleSummary& sampleSummary : batch)
+        {
+            sampleSummary.json(tmp);
+            json["b"].push_back(tmp);
+        }
+    }
+
+    return create_content_instance(parentPath, resourceName, json);
+}
+
+// Create a content instance of the given name in the given parent path, holding the given JSON object, to which the upload
+// lane latencies, uplink budget and backpressure state, and per-stage counter totals since the previous report are appended
+// if appendStats is set.  If named, a content instance found to exist already, i.e. created by an earlier attempt whose
+// response was lost, is taken as created.
+// NOTE Only to be called from the report queue thread, as it reads the upload scheduler.
+bool create_content_instance(const std::string& parentPath, const std::string& resourceName, ordered_json& json,
+                             bool appendStats)
 {
     m2m::Request request = appEntity.newRequest(xsd::m2m::Operation::Create, m2m::To{parentPath});
     request.req->resourceType = xsd::m2m::ResourceType::contentInstance;
@@ -525,18 +1005,56 @@ bool create_content_instance(const std::string& parentPath, const std::string& r
     if (resourceName != "")
         cin.resourceName = resourceName;
 
-    ordered_json json;
-    sampleSummary.json(json);
-    auto json_str = json.dump();
+    if (appendStats && uploadScheduler.count() > 0)
+    {
+        ordered_json ul;
+        uploadScheduler.json(ul);
+        json["ul"] = ul;
+        uploadScheduler.reset();
+    }
+    if (appendStats && uplinkBudget.limited())
+    {
+        ordered_json bu;
+        uplinkBudget.json(bu, system_clock::now());
+        json["bu"] = bu;
+    }
+    if (appendStats && backpressure.periodFactor() > 1)
+    {
+        ordered_json bp;
+        backpressure.json(bp);
+        json["bp"] = bp;
+    }
+
+    std::string json_str;
+    {
+        PERF_SCOPE(Perf::Stage::Json);
+        json_str = json.dump();
+    }
+#ifdef PERF_COUNTERS
+    // Append the per-stage counter totals since the previous report.
+    if (appendStats && Perf::enabled())
+    {
+        ordered_json perf;
+        Perf::json(perf);
+        json["perf"] = perf;
+        json_str = json.dump();
+        Perf::reset();
+    }
+#endif
     for (int i = 0; i < json_str.length(); i += 150)
         logDebug("JSON [" << i << "]: " << json_str.substr(i, i + 150));
     cin.content = xsd::toAnyTypeUnnamed(json_str);
 
     request.req->primitiveContent = xsd::toAnyNamed(cin);
 
-    appEntity.sendRequest(request);
+    sendRequest(request, json_str.length());
     auto response = appEntity.getResponse(request);
 
+    if (response->responseStatusCode == xsd::m2m::ResponseStatusCode::CONFLICT && resourceName != "")
+    {
+        logInfo("Content instance " << resourceName << " already created");
+        return true;
+    }
     if (response->responseStatusCode != xsd::m2m::ResponseStatusCode::CREATED)
     {
         logWarn("Content instance creation failed: " << toString(response->responseStatusCode));
@@ -562,7 +1080,7 @@ bool delete_content_instance(const std::string& path)
 
     request.req->filterCriteria = std::move(fc);
 
-    appEntity.sendRequest(request);
+    sendRequest(request);
     auto response = appEntity.getResponse(request);
 
     if (response->responseStatusCode != xsd::m2m::ResponseStatusCode::DELETED
@@ -585,6 +1103,13 @@ bool delete_content_instance(const std::string& path)
     return true;
 }
 
+// Send the given request, taking its estimated size, of the given content length plus headers, from the uplink budget.
+void sendRequest(m2m::Request& request, size_t contentBytes)
+{
+    uplinkBudget.spend(contentBytes + UPLINK_REQUEST_OVERHEAD, system_clock::now());
+    appEntity.sendRequest(request);
+}
+
 // WARNING Calling appEntity.sendRequest() from within this callback handler may deadlock the CoAP stack. Use a separate thread to
 // send requests instead.
 void notificationCallback(m2m::Notification notification)
@@ -610,15 +1135,26 @@ void notificationCallback(m2m::Notification notification)
     // Use the con element to decide how to handle the notification:
     //   * {"con":{"svcdat":...}...}: Accumulate the metersvc data
     //   * {"con":"{'reportInterval': 3600}",...}: Change our report interval (NOTE con is a JSON-like string in this case)
+    //   * {"con":"{'reportByException': true, 'anomalyThreshold': 4.0}",...}: Change other settings; see parseConfig()
+    //   * {"con":"{'query': {'from': 1700000000, 'to': 1700086400, 'res': 900}}",...}: Send history; see parseHistoryQuery()
+    //   * {"con":"{'resend': {'from': 120, 'to': 144}}",...}: Resend retained summaries; see parseResend()
+    //   * {"con":"{\"p\":[...],\"n\":3600,...}",...}: Merge a peer's summary, or batch of summaries {"b":[...]}, if AGGREGATOR
     try
     {
-        auto json = nlohmann::json::parse(json_str);
+        nlohmann::json json;
+        {
+            PERF_SCOPE(Perf::Stage::Notify);
+            json = nlohmann::json::parse(json_str);
+        }
         auto con = json.at("con");
         if (con.find("svcdat") != con.end())
         {
             auto meterRead = contentInstance.content->extractUnnamed<xsd::mtrsvc::MeterRead>();
             auto &meterSvcData = *meterRead.meterSvcData;
-            parseMeterSvcData(meterSvcData);
+            std::string meterId;
+            if (MULTI_METER && con.find(METER_ID_KEY) != con.end() && con.at(METER_ID_KEY).is_string())
+                meterId = con.at(METER_ID_KEY).get<std::string>();
+            parseMeterSvcData(meterSvcData, meterId);
 
             return;
         }
@@ -626,15 +1162,11 @@ void notificationCallback(m2m::Notification notification)
         if (con.is_string())
         {
             auto json = nlohmann::json::parse(singleQuoteToDoubleQuote(con.get<std::string>()));
-            if (json.find("reportInterval") != json.end())
+            if (AGGREGATOR && (json.find("n") != json.end() || json.find("b") != json.end()))
             {
-                auto seconds = json.at("reportInterval");
-                if (seconds.is_number_integer())
-                    parseReportInterval(seconds);
-                else
-                    logWarn("Invalid report interval: " << con);
+                parsePeerSummary(json);
             }
-            else
+            else if (!parseConfig(json))
             {
                 logInfo("Invalid string con: " << con.dump());
             }
@@ -650,6 +1182,203 @@ void notificationCallback(m2m::Notification notification)
     }
 }
 
+// Apply each recognised setting in the given configuration object:
+//   * reportInterval: Report period in seconds
+//   * reportByException: true to send only a heartbeat in place of each unremarkable summary, false to send all summaries
+//   * anomalyThreshold: Anomaly score above which a summary is sent in full when reporting by exception
+//   * profileTolerance: {"v": <volts>, "p": <watts>}, the maximum deviations of the load profiles (if LOAD_PROFILE)
+//   * demandWindow: Length of the peak demand window, in minutes (own meter only)
+//   * tou: {"periods": [<name>, ...], "rules": [...]}, the time-of-use calendar; see TouCalendar::set() (if TIME_OF_USE)
+//   * query: {"from": <time>, "to": <time>, "res": <seconds>}, a range of on-device history to send
+//   * resend: {"from": <sequence>, "to": <sequence>}, a range of retained summaries to send again
+//   * laneWeights: [<urgent>, <report>, <bulk>], the number of consecutive turns each upload lane takes while a lower lane is
+//     waiting before yielding one to it, 0 being strict priority
+//   * uplinkBudget: {"daily": <bytes>, "monthly": <bytes>, "offPeak": [{"from": "HH:MM", "to": "HH:MM"}, ...]}, the data budget
+//     to govern the bytes sent by, 0 being unlimited, and the local times to defer bulk uploads to, [] being any time
+//   * rebin: {<channel>: [<boundary>, ...], ...}, the boundaries to rebin each named channel's fine histogram into, null being
+//     infinity, or [] for none (own meter only, if FINE_HISTOGRAMS)
+// Returns false if the object contains no recognised settings.
+bool parseConfig(const nlohmann::json& json)
+{
+    bool recognised = false;
+
+    if (json.find("reportInterval") != json.end())
+    {
+        auto seconds = json.at("reportInterval");
+        if (seconds.is_number_integer())
+            parseReportInterval(seconds);
+        else
+            logWarn("Invalid report interval: " << seconds);
+        recognised = true;
+    }
+
+    if (json.find("reportByException") != json.end())
+    {
+        auto enable = json.at("reportByException");
+        if (enable.is_boolean())
+        {
+            reportByException = enable;
+            logInfo("Report by exception " << (reportByException ? "enabled" : "disabled"));
+        }
+        else
+        {
+            logWarn("Invalid report by exception setting: " << enable);
+        }
+        recognised = true;
+    }
+
+    if (json.find("anomalyThreshold") != json.end())
+    {
+        auto threshold = json.at("anomalyThreshold");
+        if (threshold.is_number() && threshold.get<double>() > 0.0)
+        {
+            baseline.setThreshold(threshold);
+            logInfo("Anomaly threshold set to " << baseline.getThreshold());
+        }
+        else
+        {
+            logWarn("Invalid anomaly threshold: " << threshold);
+        }
+        recognised = true;
+    }
+
+    if (json.find("demandWindow") != json.end())
+    {
+        auto minutes = json.at("demandWindow");
+        if (minutes.is_number_unsigned() && minutes.get<uint32_t>() >= 1 && minutes.get<uint32_t>() <= DEMAND_WINDOW_MAX)
+        {
+            report.setDemandWindow(minutes);
+            logInfo("Demand window set to " << minutes << " minutes");
+        }
+        else
+        {
+            logWarn("Invalid demand window: " << minutes);
+        }
+        recognised = true;
+    }
+
+#ifdef TIME_OF_USE
+    if (json.find("tou") != json.end())
+    {
+        // Detach the calendar while it is recompiled, as multi-meter workers may be reading it.
+        report.setCalendar(nullptr);
+        if (meterTable)
+            meterTable->setCalendar(nullptr);
+        if (touCalendar.set(json.at("tou")))
+            logInfo("Time-of-use calendar set with " << touCalendar.count << " periods");
+        else
+            logWarn("Invalid time-of-use calendar: " << json.at("tou"));
+        report.setCalendar(&touCalendar);
+        if (meterTable)
+            meterTable->setCalendar(&touCalendar);
+        recognised = true;
+    }
+#endif
+
+    if (json.find("query") != json.end())
+    {
+        parseHistoryQuery(json.at("query"));
+        recognised = true;
+    }
+
+    if (json.find("resend") != json.end())
+    {
+        parseResend(json.at("resend"));
+        recognised = true;
+    }
+
+    if (json.find("laneWeights") != json.end())
+    {
+        auto weights = json.at("laneWeights");
+        bool valid = weights.is_array() && weights.size() == LANES;
+        for (uint32_t lane = 0; valid && lane < LANES; lane++)
+            valid = weights[lane].is_number_unsigned();
+        if (valid)
+        {
+            std::lock_guard<std::mutex> lock(reportQueueMutex);
+            for (uint32_t lane = 0; lane < LANES; lane++)
+                uploadScheduler.setWeight(lane, weights[lane]);
+            logInfo("Upload lane weights set to " << weights);
+        }
+        else
+        {
+            logWarn("Invalid upload lane weights: " << weights);
+        }
+        recognised = true;
+    }
+
+    if (json.find("uplinkBudget") != json.end())
+    {
+        auto budget = json.at("uplinkBudget");
+        if (!budget.is_object() || !budget.value("daily", nlohmann::json(0)).is_number_unsigned()
+            || !budget.value("monthly", nlohmann::json(0)).is_number_unsigned()
+            || (budget.find("offPeak") != budget.end() && !uplinkBudget.setOffPeak(budget.at("offPeak"))))
+        {
+            logWarn("Invalid uplink budget: " << budget);
+        }
+        else
+        {
+            uplinkBudget.setBudget(budget.value("daily", (uint64_t)0), budget.value("monthly", (uint64_t)0));
+            logInfo("Uplink budget set to " << budget);
+        }
+        recognised = true;
+    }
+
+#ifdef FINE_HISTOGRAMS
+    if (json.find("rebin") != json.end())
+    {
+        auto rebin = json.at("rebin");
+        if (!rebin.is_object())
+            logWarn("Invalid rebinning: " << rebin);
+        for (auto it = rebin.begin(); rebin.is_object() && it != rebin.end(); ++it)
+        {
+            uint32_t c = 0;
+            while (c < CHANNELS && it.key() != CHANNEL_NAMES[c])
+                c++;
+
+            double boundaries[FINE_REBIN_MAX];
+            uint32_t n = 0;
+            bool valid = c < CHANNELS && it.value().is_array() && it.value().size() <= FINE_REBIN_MAX;
+            for (uint32_t i = 0; valid && i < it.value().size(); i++)
+            {
+                const auto& boundary = it.value()[i];
+                valid = boundary.is_number() || boundary.is_null();
+                boundaries[n++] = boundary.is_number() ? boundary.get<double>() : HUGE_VAL;
+            }
+
+            if (valid && report.setRebinning(c, boundaries, n))
+                logInfo("Rebinning " << it.key() << " into " << n << " bins");
+            else
+                logWarn("Invalid rebinning of " << it.key() << ": " << it.value());
+        }
+        recognised = true;
+    }
+#endif
+
+#ifdef LOAD_PROFILE
+    if (json.find("profileTolerance") != json.end())
+    {
+        static double toleranceV = PROFILE_TOLERANCE_V;
+        static double toleranceP = PROFILE_TOLERANCE_P;
+        auto tolerance = json.at("profileTolerance");
+        if (tolerance.is_object() && tolerance.value("v", toleranceV) >= 0.0 && tolerance.value("p", toleranceP) >= 0.0)
+        {
+            toleranceV = tolerance.value("v", toleranceV);
+            toleranceP = tolerance.value("p", toleranceP);
+            report.setProfileTolerance(toleranceV, toleranceP);
+            logInfo("Load profile tolerances set to " << toleranceV << " V and " << toleranceP << " W");
+        }
+        else
+        {
+            logWarn("Invalid load profile tolerance: " << tolerance);
+        }
+        recognised = true;
+    }
+#endif
+
+    return recognised;
+}
+
 void parseReportInterval(const int seconds)
 {
     logInfo("Detected config \"" << seconds << "\"");
@@ -670,7 +1399,174 @@ void parseReportInterval(const int seconds)
     logInfo("Report interval set to " << reportPeriod << " s");
 }
 
-void parseMeterSvcData(const xsd::mtrsvc::MeterSvcData& meterSvcData)
+// Queue a history query, given as {"from": <time>, "to": <time>, "res": <seconds>}, to be answered by the history query thread.
+// Times are in seconds since the epoch; "to" defaults to now, and "res", the interval to average over, to a minute.
+void parseHistoryQuery(const nlohmann::json& query)
+{
+    if (!history.isOpen())
+    {
+        logWarn("History query ignored; history disabled");
+        return;
+    }
+
+    HistoryQuery historyQuery;
+    if (!query.is_object() || !query.value("from", nlohmann::json()).is_number_unsigned()
+        || !query.value("to", nlohmann::json(0)).is_number_unsigned()
+        || !query.value("res", nlohmann::json(0)).is_number_unsigned())
+    {
+        logWarn("Invalid history query: " << query);
+        return;
+    }
+    historyQuery.from = query.at("from");
+    historyQuery.to = query.value("to", (uint32_t)time(nullptr));
+    historyQuery.resolution = query.value("res", QUERY_RESOLUTION_DEFAULT);
+    historyQuery.retained = false;
+    if (historyQuery.to < historyQuery.from || historyQuery.resolution < 60 || historyQuery.resolution % 60 != 0)
+    {
+        logWarn("Invalid history query range or resolution: " << query);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(queryQueueMutex);
+    if (queryQueue.size() >= QUERY_QUEUE_MAX)
+    {
+        logWarn("Too many history queries outstanding; query dropped");
+        return;
+    }
+    queryQueue.push(historyQuery);
+    logDebug("Queued history query");
+}
+
+// Queue a request, given as {"from": <sequence>, "to": <sequence>}, to resend retained summaries.  "to" defaults to the most
+// recent summary sent.
+void parseResend(const nlohmann::json& resend)
+{
+    HistoryQuery historyQuery;
+    if (!resend.is_object() || !resend.value("from", nlohmann::json()).is_number_unsigned()
+        || !resend.value("to", nlohmann::json(0)).is_number_unsigned())
+    {
+        logWarn("Invalid resend request: " << resend);
+        return;
+    }
+    historyQuery.from = resend.at("from");
+    historyQuery.to = resend.value("to", retainedSummaries.lastSequence());
+    historyQuery.resolution = 1;
+    historyQuery.retained = true;
+    if (historyQuery.from == 0 || historyQuery.to < historyQuery.from)
+    {
+        logWarn("Invalid resend range: " << resend);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(queryQueueMutex);
+    if (queryQueue.size() >= QUERY_QUEUE_MAX)
+    {
+        logWarn("Too many history queries outstanding; resend request dropped");
+        return;
+    }
+    queryQueue.push(historyQuery);
+    logDebug("Queued resend request");
+}
+
+// Retain a compact copy of the summary, numbering it in sequence, and queue it to be sent by the report queue thread in the given
+// lane, merging the lane's backlog if too long.
+// NOTE Since we expect to be called from within the notification handler, we must call create_content_instance() asynchronously,
+// for which we use the report queue.
+void queueSummary(const SampleSummary& sampleSummary, Lane lane)
+{
+    std::lock_guard<std::mutex> lock(reportQueueMutex);
+    std::deque<QueuedSummary>& queue = reportQueue[lane];
+    steady_clock::time_point now = steady_clock::now();
+    queue.push_back({ sampleSummary, now, 0, now });
+    queue.back().summary.sequence = retainedSummaries.push(sampleSummary);
+    if (queue.size() > BACKLOG_MERGE)
+        mergeBacklog(queue);
+    reportQueueCondition.notify_all();
+    logDebug("Queued summary " << queue.back().summary.sequence << " of " << sampleSummary.count << " samples, lane " << lane);
+}
+
+// Merge each queued summary into the one before it of the same meter, if any, roughly halving the number queued, to bound the
+// memory the backlog takes at the cost of coarser summaries.  Each merged summary keeps the sequence number and queued time of
+// the older, and counts its sources; the retained copies of the summaries merged are kept, so may still be resent separately.
+// Summaries already attempted are not merged, as they may have been created under their names.
+// NOTE Call with reportQueueMutex held.
+void mergeBacklog(std::deque<QueuedSummary>& queue)
+{
+    size_t before = queue.size();
+    for (size_t i = 0; i < queue.size(); i++)
+    {
+        SampleSummary& older = queue[i].summary;
+        if (queue[i].attempts > 0)
+            continue;
+        for (size_t k = i + 1; k < queue.size(); k++)
+        {
+            const SampleSummary& newer = queue[k].summary;
+            if (strcmp(newer.meterId, older.meterId) != 0 || newer.count == 0 || queue[k].attempts > 0)
+                continue;
+
+            if (older.sources == 0)
+                older.sources = 1;
+            older.merge(newer);
+            older.heartbeat = older.heartbeat && newer.heartbeat;
+            older.score = fmax(older.score, newer.score);       // NOTE fmax() ignores a NaN argument
+            older.compliance = newer.compliance;
+            older.complianceLast = newer.complianceLast;
+            queue.erase(queue.begin() + k);
+            break;
+        }
+    }
+
+    logWarn("Backlog of " << before << " summaries merged to " << queue.size());
+}
+
+// Return the number of summaries queued in all lanes.
+size_t queuedSummaries()
+{
+    std::lock_guard<std::mutex> lock(reportQueueMutex);
+    return reportQueue[LANE_URGENT].size() + reportQueue[LANE_REPORT].size();
+}
+
+// Merge the given peer summary, or batch of peer summaries, into the aggregate.
+void parsePeerSummary(const nlohmann::json& json)
+{
+    SampleSummary peerSummary;
+    auto batch = json.find("b");
+    if (json.find("hb") != json.end())
+    {
+        logDebug("Ignoring peer heartbeat");                    // Heartbeats carry no statistics to merge
+    }
+    else if (batch == json.end())
+    {
+        if (peerSummary.set(json))
+            aggregate.merge(peerSummary);
+        else
+            logWarn("Invalid peer summary");
+    }
+    else if (batch->is_array())
+    {
+        for (auto& j : *batch)
+        {
+            if (peerSummary.set(j))
+                aggregate.merge(peerSummary);
+            else
+                logWarn("Invalid peer summary in batch");
+        }
+    }
+
+    logDebug("Aggregated " << aggregate.sources << " summaries of " << aggregate.count << " samples");
+}
+
+// Queue our own summary to be sent in the given lane, or if we are an aggregator, merge it into the aggregate.
+void reportSummary(const SampleSummary& sampleSummary, Lane lane)
+{
+    if (AGGREGATOR)
+        aggregate.merge(sampleSummary);
+    else
+        queueSummary(sampleSummary, lane);
+}
+
+// Accumulate the given metersvc data, reported by the meter with the given ID (only used if MULTI_METER).
+void parseMeterSvcData(const xsd::mtrsvc::MeterSvcData& meterSvcData, const std::string& meterId)
 {
     // If the time to send a report has arrived, do so before parsing the new data.
     milliseconds timeNow = duration_cast<milliseconds>(steady_clock::now().time_since_epoch());
@@ -681,19 +1577,66 @@ void parseMeterSvcData(const xsd::mtrsvc::MeterSvcData& meterSvcData)
             // First run; set an initial report time and continue.
             reportTime = timeNow + milliseconds(reportPeriod * 1000 - 500);
             report.reset();
+            if (meterTable)
+                meterTable->reset();
         }
         else
         {
-            SampleSummary sampleSummary;
-            report.summarise(sampleSummary);
+            // Measure the backlog left by the previous reports before queueing this one.
+            uint32_t backlogFactor = backpressure.update(queuedSummaries(), milliseconds(reportPeriod * 1000),
+                                                         steady_clock::now());
 
-            // NOTE Since we expect to be called from within the notification handler, we must call create_content_instance()
-            // asynchronously, for which we use the sample queue.
-            reportQueue.push(sampleSummary);
-            logDebug("Queued summary of " << sampleSummary.count << " samples");
+            if (meterTable)
+            {
+                // Allocated once, on first use, to keep these off the notification handler's stack.
+                static std::unique_ptr<SampleSummary[]> summaries(new SampleSummary[MAX_METERS]);
+                uint32_t n;
+                {
+                    PERF_SCOPE(Perf::Stage::Summarise);
+                    n = meterTable->summarise(summaries.get(), MAX_METERS);
+                }
+                for (uint32_t i = 0; i < n; i++)
+                    reportSummary(summaries[i]);
+            }
+            else
+            {
+                SampleSummary sampleSummary;
+                {
+                    PERF_SCOPE(Perf::Stage::Summarise);
+                    report.summarise(sampleSummary);
+                }
+                compliance.summarise(sampleSummary.compliance, sampleSummary.complianceLast);
+                sampleSummary.duplicates = reorderBuffer.duplicates;
+                sampleSummary.late = reorderBuffer.late;
+                sampleSummary.resyncs = reorderBuffer.resyncs;
+                reorderBuffer.duplicates = reorderBuffer.late = reorderBuffer.resyncs = 0;
+
+                // Score the summary against the baseline, and if reporting by exception, send only a heartbeat if unremarkable.
+                bool anomalous = baseline.score(sampleSummary);
+                baseline.update(sampleSummary);
+                if (reportByException && !anomalous)
+                    sampleSummary.heartbeat = true;
+                logDebug("Anomaly score " << sampleSummary.score << (anomalous ? " (anomalous)" : ""));
+
+                // Send anomalous summaries ahead of any backlog, as the events of most interest.
+                reportSummary(sampleSummary, anomalous ? LANE_URGENT : LANE_REPORT);
+                report.reset();
+            }
 
-            report.reset();
-            reportTime += milliseconds(reportPeriod * 1000);
+            // Send a single aggregate of all the summaries received during the report period.
+            if (AGGREGATOR && aggregate.count > 0)
+            {
+                strncpy(aggregate.meterId, AGGREGATE_METER_ID.c_str(), METER_ID_LENGTH);
+                aggregate.meterId[METER_ID_LENGTH] = '\0';
+                queueSummary(aggregate);
+                aggregate.reset();
+            }
+
+            // Lengthen the period to the next report while the uplink budget is low, or the backlog is not draining.
+            uint32_t factor = std::max(uplinkBudget.periodFactor(system_clock::now()), backlogFactor);
+            if (factor > 1)
+                logInfo("Uplink budget low or backlog not draining; next report in " << reportPeriod * factor << " s");
+            reportTime += milliseconds(reportPeriod * 1000) * factor;
             if (reportTime <= timeNow)                          // Sanity check
             {
                 logWarn("Report time in the past; resetting to " << reportPeriod << " s from now");
@@ -707,19 +1650,81 @@ void parseMeterSvcData(const xsd::mtrsvc::MeterSvcData& meterSvcData)
     if (SPOOF_METER)
     {
         spoofSample(sample);
-        report.accumulate(sample);
+        {
+            PERF_SCOPE(Perf::Stage::Accumulate);
+            report.accumulate(sample);
+        }
         logInfo("Accumulated " << report.count() << (report.count() == 1 ? " sample" : " samples"));
     }
     else if (meterSvcData.powerQuality.isSet())
     {
         logDebug("powerQuality: " << *meterSvcData.powerQuality);
-        sample.set(meterSvcData.powerQuality.getValue());
-        report.accumulate(sample);
-        logInfo("Accumulated " << report.count() << (report.count() == 1 ? " sample" : " samples"));
+        {
+            PERF_SCOPE(Perf::Stage::Parse);
+            sample.set(meterSvcData.powerQuality.getValue());
+        }
+        if (meterTable)
+        {
+            // NOTE Samples of multiple meters are accumulated as of when they arrive, bypassing the reorder buffer, compliance and
+            // history, which are single meter state: one meter's reads would be taken as duplicates or late against another's,
+            // and compliance and history, whose records carry no meter ID, would interleave the meters.  Giving each meter its
+            // own would multiply their memory, so multi-meter mode reports the summaries only.
+            bool success;
+            {
+                PERF_SCOPE(Perf::Stage::Accumulate);
+                success = meterTable->accumulate(meterId.c_str(), sample);
+            }
+            if (success)
+                logDebug("Accumulated sample for meter \"" << meterId << "\"");
+            else
+                logWarn("Meter table full; dropped sample for meter \"" << meterId << "\"");
+        }
+        else if (!parseReadTime(meterSvcData.readTimeLocal, sample.ts))
+        {
+            logWarn("Unable to parse read time \"" << meterSvcData.readTimeLocal << "\"; accumulating sample as of now");
+            accumulateSample(sample);
+        }
+        else if (reorderBuffer.push(sample))
+        {
+            // Accumulate the samples in the order read, holding back any read after a sample yet to arrive.
+            while (reorderBuffer.pop(sample))
+                accumulateSample(sample);
+        }
+        else
+        {
+            logWarn("Dropped duplicate or late sample read at " << meterSvcData.readTimeLocal);
+        }
     }
-    else if (meterSvcData.summations.isSet())
+
+    // Accumulate summation register readings alongside the power quality samples, to be reported in the same summary.
+    if (meterSvcData.summations.isSet())
     {
-        // Summation data are not used in this demo.
         logDebug("summations: " << *meterSvcData.summations);
+        Summations summations;
+        summations.set(nlohmann::json::parse(xsd::toAnyTypeUnnamed(*meterSvcData.summations).dumpJson()), SUMMATION_REGISTERS,
+                       sizeof SUMMATION_REGISTERS / sizeof SUMMATION_REGISTERS[0]);
+        bool success = meterTable ? meterTable->accumulate(meterId.c_str(), summations) : report.accumulate(summations);
+        if (success)
+            logDebug("Accumulated " << summations.count << " summation registers");
+        else
+            logWarn("Too many summation registers; some readings dropped");
+    }
+}
+
+// Accumulate the given sample of our own meter, as of the time it was read if known, or else now.
+void accumulateSample(const Sample& sample)
+{
+    {
+        PERF_SCOPE(Perf::Stage::Accumulate);
+        report.accumulate(sample);
     }
+    time_point<system_clock> ts = sample.ts != system_clock::from_time_t(0) ? sample.ts : system_clock::now();
+    compliance.accumulate(ts, sample);
+    logInfo("Accumulated " << report.count() << (report.count() == 1 ? " sample" : " samples"));
+
+    // Record each minute's averages in the on-device history.
+    History::Record record;
+    if (history.isOpen() && downsampler.accumulate((uint32_t)system_clock::to_time_t(ts), sample, record)
+        && !history.append(record))
+        logWarn("Unable to append to history store");
 }
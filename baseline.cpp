@@ -0,0 +1,85 @@
+#include <time.h>                                               // localtime_r()
+
+#include <cmath>                                                // std::isnan()
+
+#include "baseline.h"
+
+using namespace Meter;
+
+// Score the sample summary against the baseline for its hour of the day, storing the score in the sample summary.
+// Returns true if the summary is anomalous, i.e. its score exceeds the threshold, or there is not yet enough history to say.
+bool Baseline::score(SampleSummary& sampleSummary) const
+{
+    const Hour& hour = hours[hourOf(sampleSummary)];
+    double maxZ = 0.0;
+
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        double avg = sampleSummary.channel(c).avg;
+        if (std::isnan(avg) || hour.count == 0)
+            continue;
+
+        double sigma = sqrt(hour.variance[c]);
+        double sigmaFloor = BASELINE_SIGMA_FLOOR * fabs(hour.mean[c]) + BASELINE_SIGMA_MIN;
+        if (sigma < sigmaFloor)
+            sigma = sigmaFloor;
+
+        double z = fabs(avg - hour.mean[c]) / sigma;
+        if (z > maxZ)
+            maxZ = z;
+    }
+
+    sampleSummary.score = maxZ;
+
+    return hour.count < BASELINE_WARMUP || maxZ > threshold;
+}
+
+// Update the baseline for the summary's hour of the day with its channel averages.
+void Baseline::update(const SampleSummary& sampleSummary)
+{
+    if (sampleSummary.count == 0)
+        return;
+
+    Hour& hour = hours[hourOf(sampleSummary)];
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        double avg = sampleSummary.channel(c).avg;
+        if (std::isnan(avg))
+            continue;
+
+        if (hour.count == 0)
+        {
+            hour.mean[c] = avg;
+            hour.variance[c] = 0.0;
+        }
+        else
+        {
+            double diff = avg - hour.mean[c];
+            double increment = BASELINE_ALPHA * diff;
+            hour.mean[c] += increment;
+            hour.variance[c] = (1.0 - BASELINE_ALPHA) * (hour.variance[c] + diff * increment);
+        }
+    }
+    hour.count++;
+}
+
+void Baseline::reset()
+{
+    for (Hour& hour : hours)
+    {
+        for (uint32_t c = 0; c < CHANNELS; c++)
+            hour.mean[c] = hour.variance[c] = 0.0;
+        hour.count = 0;
+    }
+}
+
+// Return the local hour of the day in which the sample summary started.
+uint32_t Baseline::hourOf(const SampleSummary& sampleSummary)
+{
+    time_t t = system_clock::to_time_t(sampleSummary.tsStart);
+    struct tm tm;
+    if (localtime_r(&t, &tm) == nullptr)
+        return 0;
+
+    return tm.tm_hour;
+}
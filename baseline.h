@@ -0,0 +1,55 @@
+// Hour-of-day baselines of each measured channel's average, for on-device anomaly detection.
+//
+// Usage:
+//
+//    using namespace Meter;
+//    Baseline baseline;
+//    SampleSummary sampleSummary;
+//    report.summarise(sampleSummary);
+//    if (!baseline.score(sampleSummary))
+//        ... uneventful, so send a heartbeat instead ...
+//    baseline.update(sampleSummary);
+//
+// For each hour of the day, an exponentially weighted moving average and variance of every channel's average is maintained
+// incrementally.  A summary's score is the largest number of standard deviations by which any channel's average departs from the
+// baseline for the hour in which the summary started.  Each channel's standard deviation is floored at a fraction of its mean,
+// so that a perfectly steady channel does not make every subsequent wobble anomalous.
+
+#pragma once
+
+#include <cstdint>
+
+#include "meter.h"
+
+namespace Meter
+{
+    static constexpr double BASELINE_ALPHA = 0.1;               // EWMA weight of each new summary
+    static constexpr double BASELINE_SIGMA_FLOOR = 0.01;        // Minimum standard deviation, as a fraction of the mean
+    static constexpr double BASELINE_SIGMA_MIN = 0.001;         // Minimum standard deviation, in absolute terms
+    static constexpr uint32_t BASELINE_WARMUP = 7;              // Summaries per hour of day before any can be unremarkable
+
+    class Baseline
+    {
+    public:
+        Baseline() { threshold = 4.0; reset(); }
+        bool score(SampleSummary& sampleSummary) const;
+        void update(const SampleSummary& sampleSummary);
+        void setThreshold(double threshold_) { threshold = threshold_; }
+        double getThreshold() const { return threshold; }
+        void reset();
+
+    private:
+        // Moving average and variance of each channel's average, over the summaries starting in a given hour of the day.
+        struct Hour
+        {
+            double mean[CHANNELS];
+            double variance[CHANNELS];
+            uint32_t count;
+        };
+
+        static uint32_t hourOf(const SampleSummary& sampleSummary);
+
+        Hour hours[24];
+        double threshold;                                       // Score above which a summary is anomalous
+    };
+}
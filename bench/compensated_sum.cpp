@@ -0,0 +1,116 @@
+// Standalone check of the accuracy and overhead of CompensatedSum against a plain double sum.
+//
+// Usage (from the repository root, with the SDK headers meter.h includes on the include path):
+//
+//    g++ -std=gnu++14 -O2 -I. -I<sdk include> -o compensated_sum bench/compensated_sum.cpp
+//    ./compensated_sum [days]
+//
+// It lives outside the top level so that the app's Makefile, which builds every top level .cpp, does not link it in.
+//
+// Accuracy: a synthetic stream of per-second power readings over the given number of days (default 31, a month) near 1.2e5
+// with a spread of +/-5e3 is summed both plainly and with CompensatedSum.  Each reading is a multiple of 2^-20, so the exact
+// total is held as an integer, against which both errors are reported.  The check fails if the compensated total is out by
+// more than an ulp of the total, as CompensatedSum guarantees a few ulps at most however many readings are summed.
+//
+// Overhead: the time per value of each sum over the same stream, as the best of several runs, so that the cost is seen against
+// that of the accumulation it is part of (a few hundred ns per sample).
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "meter.h"
+
+using namespace std::chrono;
+using Meter::CompensatedSum;
+
+static constexpr double SCALE = 1048576.0;                     // 2^20; readings are whole multiples of its reciprocal
+static constexpr double MEAN = 1.2e5;
+static constexpr double SPREAD = 5e3;
+static constexpr uint32_t RUNS = 5;
+
+// Return the smallest time per value of the given function over RUNS runs, in ns.
+template <typename F>
+static double nsPerValue(F f, size_t n)
+{
+    double best = INFINITY;
+    for (uint32_t run = 0; run < RUNS; run++)
+    {
+        auto start = steady_clock::now();
+        f();
+        best = fmin(best, duration<double, std::nano>(steady_clock::now() - start).count() / n);
+    }
+
+    return best;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t days = argc > 1 ? (uint32_t)atoi(argv[1]) : 31;
+    size_t n = (size_t)days * 24 * 3600;
+    if (n == 0)
+    {
+        fprintf(stderr, "Usage: %s [days]\n", argv[0]);
+        return 2;
+    }
+
+    // Fixed seed, so that runs are comparable.
+    std::mt19937_64 generator(20240101);
+    std::uniform_int_distribution<int64_t> spread((int64_t)(-SPREAD * SCALE), (int64_t)(SPREAD * SCALE));
+    std::vector<double> values(n);
+    int64_t exact = 0;                                          // In units of 2^-20; at most 3.5e17 for a month, so no overflow
+    for (size_t i = 0; i < n; i++)
+    {
+        int64_t units = (int64_t)(MEAN * SCALE) + spread(generator);
+        exact += units;
+        values[i] = units / SCALE;
+    }
+
+    double plain = 0.0;
+    CompensatedSum compensated;
+    for (double value : values)
+    {
+        plain += value;
+        compensated.add(value);
+    }
+
+    // A long double holds the integer exactly, and the division by a power of two is exact.
+    long double total = (long double)exact / SCALE;
+    double plainError = (double)fabsl(plain - total);
+    double compensatedError = (double)fabsl(compensated.value() - total);
+    double ulp = nextafter((double)total, INFINITY) - (double)total;
+
+    printf("%u days, %zu values, total %.6f\n", days, n, (double)total);
+    printf("Error: plain %.3g, compensated %.3g (ulp of total %.3g)\n", plainError, compensatedError, ulp);
+
+    // volatile sinks, so that the timed sums are not optimised away.
+    volatile double sink;
+    double plainNs = nsPerValue([&]
+    {
+        double sum = 0.0;
+        for (double value : values)
+            sum += value;
+        sink = sum;
+    }, n);
+    double compensatedNs = nsPerValue([&]
+    {
+        CompensatedSum sum;
+        for (double value : values)
+            sum.add(value);
+        sink = sum.value();
+    }, n);
+    (void)sink;
+    printf("Time per value: plain %.2f ns, compensated %.2f ns\n", plainNs, compensatedNs);
+
+    if (compensatedError > ulp)
+    {
+        printf("FAIL: compensated error exceeds an ulp of the total\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+// Standalone benchmark of MeterTable ingest throughput by number of worker threads.
+//
+// Usage (from the repository root, with the SDK headers meter.h includes on the include path):
+//
+//    g++ -std=gnu++14 -O2 -pthread -I. -I<sdk include> -o multimeter_scaling bench/multimeter_scaling.cpp multimeter.cpp meter.cpp
+//    ./multimeter_scaling [samples]
+//
+// It lives outside the top level so that the app's Makefile, which builds every top level .cpp, does not link it in.
+//
+// A fixed, pseudo-random set of three phase samples is accumulated round robin into MAX_METERS meters, enough to be sharded,
+// by a table limited to 0 (inline), then 1 to MAX_WORKERS workers.  Each is timed from the first sample to the last being
+// accumulated, as the best of several runs, and reported in samples per second.  The workers started are also limited to one
+// per core, and none are started on a single core, so run it on the target.  The samples are built up front, so this is the
+// ceiling on throughput: in the app, the calling thread also parses each sample, which does not scale with the workers.
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "multimeter.h"
+
+using namespace Meter;
+
+static constexpr uint32_t SAMPLES_DISTINCT = 1024;
+static constexpr uint32_t RUNS = 3;
+
+int main(int argc, char* argv[])
+{
+    uint32_t n = argc > 1 ? (uint32_t)atoi(argv[1]) : 200000;
+    if (n == 0)
+    {
+        fprintf(stderr, "Usage: %s [samples]\n", argv[0]);
+        return 2;
+    }
+
+    // Fixed seed, so that runs are comparable.
+    std::mt19937 generator(3);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    std::vector<Sample> samples(SAMPLES_DISTINCT);
+    for (Sample& sample : samples)
+    {
+        Phase* phases[3] = { &sample.p1, &sample.p2, &sample.p3 };
+        for (Phase* phase : phases)
+            phase->set(230.0 + normal(generator), 5.0 + normal(generator), 1000.0 + 50.0 * normal(generator),
+                       100.0 + 10.0 * normal(generator), 0.95);
+        sample.frequency = 50.0 + 0.01 * normal(generator);
+    }
+
+    std::vector<std::string> meterIds;
+    for (uint32_t m = 0; m < MAX_METERS; m++)
+        meterIds.push_back("meter" + std::to_string(m));
+
+    printf("%u cores, %u meters, %u samples\n", std::thread::hardware_concurrency(), MAX_METERS, n);
+    std::unique_ptr<SampleSummary[]> summaries(new SampleSummary[MAX_METERS]);
+    double inline_ = NAN;
+    for (uint32_t workers = 0; workers <= MAX_WORKERS; workers++)
+    {
+        double best = INFINITY;
+        for (uint32_t run = 0; run < RUNS; run++)
+        {
+            std::unique_ptr<MeterTable> table(new MeterTable(workers));
+            time_point<system_clock> ts = system_clock::from_time_t(1700000000);
+
+            auto start = steady_clock::now();
+            for (uint32_t i = 0; i < n; i++)
+            {
+                Sample& sample = samples[i % SAMPLES_DISTINCT];
+                if (i % MAX_METERS == 0)
+                    ts += seconds(1);
+                sample.ts = ts;
+                table->accumulate(meterIds[i % MAX_METERS].c_str(), sample);
+            }
+            table->summarise(summaries.get(), MAX_METERS);      // Waits for the workers to drain their queues
+            best = fmin(best, duration<double>(steady_clock::now() - start).count());
+        }
+
+        if (workers == 0)
+            inline_ = best;
+        printf("%u workers: %9.0f samples/s (%.2fx inline)\n", workers, n / best, inline_ / best);
+    }
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+// Standalone benchmark of the time Report::accumulate() takes per sample, with the samples spread over a number of Reports.
+//
+// Usage (from the repository root, with the SDK headers meter.h includes on the include path):
+//
+//    g++ -std=gnu++14 -O2 -I. -I<sdk include> -o report_accumulate bench/report_accumulate.cpp meter.cpp
+//    ./report_accumulate [samples]
+//
+// It lives outside the top level so that the app's Makefile, which builds every top level .cpp, does not link it in.
+//
+// A fixed, pseudo-random set of three phase samples is accumulated round robin into 1, 4, 32 and 256 Reports, as for that many
+// meters, so that the state being updated grows from fitting in L1 to well beyond L2.  Each count is timed as the best of
+// several runs, reported in ns per sample.  To compare accumulator layouts, build it against each and run both on the target.
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "meter.h"
+
+using namespace Meter;
+
+static constexpr uint32_t SAMPLES_DISTINCT = 1024;
+static constexpr uint32_t RUNS = 5;
+static constexpr uint32_t REPORTS[] = { 1, 4, 32, 256 };
+
+int main(int argc, char* argv[])
+{
+    uint32_t n = argc > 1 ? (uint32_t)atoi(argv[1]) : 200000;
+    if (n == 0)
+    {
+        fprintf(stderr, "Usage: %s [samples]\n", argv[0]);
+        return 2;
+    }
+
+    // Fixed seed, so that runs are comparable.
+    std::mt19937 generator(3);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    std::vector<Sample> samples(SAMPLES_DISTINCT);
+    for (Sample& sample : samples)
+    {
+        Phase* phases[3] = { &sample.p1, &sample.p2, &sample.p3 };
+        for (Phase* phase : phases)
+            phase->set(230.0 + normal(generator), 5.0 + normal(generator), 1000.0 + 50.0 * normal(generator),
+                       100.0 + 10.0 * normal(generator), 0.95);
+        sample.frequency = 50.0 + 0.01 * normal(generator);
+    }
+
+    printf("sizeof (Report) %zu bytes, %u samples\n", sizeof (Report), n);
+    static Report reports[REPORTS[sizeof REPORTS / sizeof REPORTS[0] - 1]];   // Static, so cache line aligned before C++17
+    for (uint32_t count : REPORTS)
+    {
+        double best = INFINITY;
+        for (uint32_t run = 0; run < RUNS; run++)
+        {
+            for (uint32_t r = 0; r < count; r++)
+                reports[r].reset();
+            time_point<system_clock> ts = system_clock::from_time_t(1700000000);
+
+            auto start = steady_clock::now();
+            for (uint32_t i = 0; i < n; i++)
+            {
+                Sample& sample = samples[i % SAMPLES_DISTINCT];
+                if (i % count == 0)
+                    ts += seconds(1);
+                sample.ts = ts;
+                reports[i % count].accumulate(sample);
+            }
+            best = fmin(best, duration<double, std::nano>(steady_clock::now() - start).count() / n);
+        }
+
+        SampleSummary summary;
+        reports[0].summarise(summary);
+        printf("%4u reports: %7.1f ns/sample (Vrms avg %.1f)\n", count, best, summary.p1.vrms.avg);
+    }
+
+    return 0;
+}
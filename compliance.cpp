@@ -0,0 +1,213 @@
+#include <cmath>
+
+#include "compliance.h"
+
+using namespace Meter;
+
+static constexpr double NOMINAL_VOLTAGE = EXPECTED_VOLTAGE;
+static constexpr double NOMINAL_FREQUENCY = EXPECTED_FREQUENCY;
+static constexpr double VOLTAGE_ABSENT = 1.0;                   // Aggregates below this percentage of nominal are not counted
+static constexpr double FREQUENCY_LIMIT_LOW = 0.94;             // Limits all frequency aggregates must lie within, of nominal
+static constexpr double FREQUENCY_LIMIT_HIGH = 1.04;
+static constexpr double FREQUENCY_MARGIN = 0.01;                // Histogram range beyond the limits, so they fall within a bin
+
+template <uint32_t BINS>
+void Compliance::Distribution<BINS>::reset(double low_, double width_)
+{
+    low = low_;
+    width = width_;
+    count = below = above = 0;
+    for (uint32_t i = 0; i < BINS; i++)
+        bin[i] = 0;
+}
+
+template <uint32_t BINS>
+void Compliance::Distribution<BINS>::add(double value)
+{
+    count++;
+    double i = floor((value - low) / width);
+    if (i < 0.0)
+        below++;
+    else if (i >= BINS)
+        above++;
+    else
+        bin[(uint32_t)i]++;
+}
+
+// Return the number of values in the bins that lie wholly within [from, to].
+template <uint32_t BINS>
+uint32_t Compliance::Distribution<BINS>::countWithin(double from, double to) const
+{
+    double first = ceil((from - low) / width - 1e-6);           // Allow for the limits being computed from the nominal
+    double end = floor((to - low) / width + 1e-6);
+    uint32_t n = 0;
+    for (uint32_t i = (uint32_t)fmax(first, 0.0); i < fmin(end, BINS); i++)
+        n += bin[i];
+
+    return n;
+}
+
+// Return the given percentile of the values, as the middle of the bin it falls in, or the limit of the range if outside it,
+// or NaN if there are no values.
+template <uint32_t BINS>
+double Compliance::Distribution<BINS>::percentile(double p) const
+{
+    if (count == 0)
+        return NAN;
+
+    uint32_t rank = (uint32_t)fmax(ceil(p / 100.0 * count), 1.0);
+    uint32_t n = below;
+    if (n >= rank)
+        return low;
+    for (uint32_t i = 0; i < BINS; i++)
+    {
+        n += bin[i];
+        if (n >= rank)
+            return low + (i + 0.5) * width;
+    }
+
+    return low + BINS * width;
+}
+
+void Compliance::Week::reset(uint32_t start_)
+{
+    start = start_;
+    for (uint32_t phase = 0; phase < 3; phase++)
+        voltage[phase].reset(80.0, 40.0 / COMPLIANCE_VOLTAGE_BINS);
+    double frequencyRange = (FREQUENCY_LIMIT_HIGH - FREQUENCY_LIMIT_LOW + 2 * FREQUENCY_MARGIN) * NOMINAL_FREQUENCY;
+    frequency.reset((FREQUENCY_LIMIT_LOW - FREQUENCY_MARGIN) * NOMINAL_FREQUENCY, frequencyRange / COMPLIANCE_FREQUENCY_BINS);
+    unbalance.reset(0.0, 10.0 / COMPLIANCE_UNBALANCE_BINS);
+}
+
+// Summarise the week's aggregates against the limits of EN 50160.
+void Compliance::Week::summarise(ComplianceSummary& summary) const
+{
+    summary.reset();
+    summary.weekStart = start;
+
+    for (uint32_t phase = 0; phase < 3; phase++)
+    {
+        const Distribution<COMPLIANCE_VOLTAGE_BINS>& v = voltage[phase];
+        summary.voltageCount[phase] = v.count;
+        if (v.count == 0)
+            continue;
+
+        summary.voltageInRange[phase] = 100.0 * v.countWithin(90.0, 110.0) / v.count;
+        summary.voltageInLimits[phase] = v.countWithin(85.0, 110.0) == v.count;
+        summary.voltageP5[phase] = v.percentile(5.0) * NOMINAL_VOLTAGE / 100.0;
+        summary.voltageP95[phase] = v.percentile(95.0) * NOMINAL_VOLTAGE / 100.0;
+        summary.pass = summary.pass && summary.voltageInRange[phase] >= 95.0 && summary.voltageInLimits[phase];
+    }
+
+    summary.frequencyCount = frequency.count;
+    if (frequency.count > 0)
+    {
+        summary.frequencyInRange = 100.0 * frequency.countWithin(0.99 * NOMINAL_FREQUENCY, 1.01 * NOMINAL_FREQUENCY) /
+                                   frequency.count;
+        summary.frequencyInLimits = frequency.countWithin(FREQUENCY_LIMIT_LOW * NOMINAL_FREQUENCY,
+                                                          FREQUENCY_LIMIT_HIGH * NOMINAL_FREQUENCY) == frequency.count;
+        summary.frequencyP0_5 = frequency.percentile(0.5);
+        summary.frequencyP99_5 = frequency.percentile(99.5);
+        summary.pass = summary.pass && summary.frequencyInRange >= 99.5 && summary.frequencyInLimits;
+    }
+
+    summary.unbalanceCount = unbalance.count;
+    if (unbalance.count > 0)
+    {
+        summary.unbalanceP95 = unbalance.percentile(95.0);
+        summary.pass = summary.pass && summary.unbalanceP95 <= 2.0;
+    }
+}
+
+// Return the week holding the given time, starting a new week if it is not the week in progress, in which case the week in
+// progress is summarised as the last complete week.
+Compliance::Week& Compliance::weekOf(uint32_t ts)
+{
+    static constexpr uint32_t MONDAY = 3 * 24 * 3600;           // The epoch was a Thursday
+    uint32_t start = (ts + MONDAY) / COMPLIANCE_WEEK * COMPLIANCE_WEEK - MONDAY;
+    if (start != week.start)
+    {
+        if (week.start != 0)
+            week.summarise(last);
+        week.reset(start);
+    }
+
+    return week;
+}
+
+// Accumulate the sample into the aggregates of its 10 second and 10 minute intervals, first counting the aggregates of the
+// intervals it has moved on from.
+void Compliance::accumulate(time_point<system_clock> ts, const Sample& sample)
+{
+    uint32_t t = duration_cast<seconds>(ts.time_since_epoch()).count();
+
+    uint32_t interval = t - t % COMPLIANCE_FREQUENCY_INTERVAL;
+    if (interval != frequencyInterval)
+    {
+        if (frequencyCount > 0)
+            weekOf(frequencyInterval).frequency.add(frequencySum / frequencyCount);
+        frequencyInterval = interval;
+        frequencyCount = 0;
+        frequencySum = 0.0;
+    }
+    if (sample.frequency > 0.0)
+    {
+        frequencySum += sample.frequency;
+        frequencyCount++;
+    }
+
+    interval = t - t % COMPLIANCE_VOLTAGE_INTERVAL;
+    if (interval != voltageInterval)
+    {
+        if (voltageCount > 0)
+        {
+            Week& w = weekOf(voltageInterval);
+            for (uint32_t phase = 0; phase < 3; phase++)
+            {
+                double percentage = 100.0 * sqrt(voltageSumSquares[phase] / voltageCount) / NOMINAL_VOLTAGE;
+                if (percentage >= VOLTAGE_ABSENT)
+                    w.voltage[phase].add(percentage);
+            }
+        }
+        if (unbalanceCount > 0)
+            weekOf(voltageInterval).unbalance.add(sqrt(unbalanceSumSquares / unbalanceCount));
+        voltageInterval = interval;
+        voltageCount = unbalanceCount = 0;
+        voltageSumSquares[0] = voltageSumSquares[1] = voltageSumSquares[2] = unbalanceSumSquares = 0.0;
+    }
+
+    const Phase* phases[3] = { &sample.p1, &sample.p2, &sample.p3 };
+    for (uint32_t phase = 0; phase < 3; phase++)
+        voltageSumSquares[phase] += phases[phase]->vrms * phases[phase]->vrms;
+    voltageCount++;
+
+    // Voltage unbalance, as the greatest deviation from the average as a percentage of the average (NEMA MG 1), as for the
+    // derived channel.
+    if (sample.p1.vrms > 0.0 && sample.p2.vrms > 0.0 && sample.p3.vrms > 0.0)
+    {
+        double vAvg = (sample.p1.vrms + sample.p2.vrms + sample.p3.vrms) / 3;
+        double deviation = fmax(fabs(sample.p1.vrms - vAvg), fmax(fabs(sample.p2.vrms - vAvg), fabs(sample.p3.vrms - vAvg)));
+        double unbalance = 100.0 * deviation / vAvg;
+        unbalanceSumSquares += unbalance * unbalance;
+        unbalanceCount++;
+    }
+}
+
+// Summarise the week in progress into current, and the last complete week, if any, into last_.
+void Compliance::summarise(ComplianceSummary& current, ComplianceSummary& last_) const
+{
+    if (week.start != 0)
+        week.summarise(current);
+    else
+        current.reset();
+    last_ = last;
+}
+
+void Compliance::reset()
+{
+    voltageInterval = frequencyInterval = 0;
+    voltageCount = unbalanceCount = frequencyCount = 0;
+    voltageSumSquares[0] = voltageSumSquares[1] = voltageSumSquares[2] = unbalanceSumSquares = frequencySum = 0.0;
+    week.reset(0);
+    last.reset();
+}
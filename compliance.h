@@ -0,0 +1,95 @@
+// Weekly assessment of the supply voltage, frequency and voltage unbalance against EN 50160, using IEC 61000-4-30 style
+// clock-aligned aggregation.
+//
+// Usage:
+//
+//    using namespace Meter;
+//    Compliance compliance;
+//    while (...)
+//        compliance.accumulate(system_clock::now(), sample);
+//    ...
+//    compliance.summarise(sampleSummary.compliance, sampleSummary.complianceLast);
+//
+// Each phase's Vrms and the voltage unbalance are aggregated as the RMS of their samples over each clock-aligned 10 minute
+// interval, and the frequency as the mean of its samples over each clock-aligned 10 second interval.  Each aggregate is counted
+// into a fine, fixed-range histogram for the week (starting 00:00 UTC Monday) in which its interval started, from which the
+// fractions within the standard's limits and the percentiles are found without retaining the aggregates themselves.  The limits
+// checked are those of EN 50160 for low voltage networks synchronously connected to an interconnected system:
+//
+//    Voltage:    95% of 10 minute aggregates within +/-10% of nominal, and all within +10%/-15%
+//    Frequency:  99.5% of 10 second aggregates within +/-1% of nominal, and all within +4%/-6%
+//    Unbalance:  95% of 10 minute aggregates at or below 2%
+//
+// A phase whose 10 minute aggregate is below 1% of nominal is taken to be absent rather than interrupted, and is not counted.
+// The state is independent of any Report, so persists across report intervals; it is not persisted across restarts.  Aggregates
+// are counted once their interval has ended, so the week in progress lags by up to 10 minutes.
+// NOTE Not thread safe; accumulate() and summarise() are intended to be called from the same thread.
+
+#pragma once
+
+#include <cstdint>
+
+#include "meter.h"
+
+namespace Meter
+{
+    static constexpr uint32_t COMPLIANCE_VOLTAGE_INTERVAL = 600;        // Seconds per voltage and unbalance aggregate
+    static constexpr uint32_t COMPLIANCE_FREQUENCY_INTERVAL = 10;       // Seconds per frequency aggregate
+    static constexpr uint32_t COMPLIANCE_WEEK = 7 * 24 * 3600;
+    static constexpr uint32_t COMPLIANCE_VOLTAGE_BINS = 800;            // 0.05% of nominal each, from 80% to 120%
+    static constexpr uint32_t COMPLIANCE_FREQUENCY_BINS = 3600;         // From 93% to 105% of nominal; 2 mHz each at 60 Hz
+    static constexpr uint32_t COMPLIANCE_UNBALANCE_BINS = 1000;         // 0.01% each, from 0% to 10%
+
+    class Compliance
+    {
+    public:
+        Compliance() { reset(); }
+        void accumulate(time_point<system_clock> ts, const Sample& sample);
+        void summarise(ComplianceSummary& current, ComplianceSummary& last_) const;
+        void reset();
+
+    private:
+        // Histogram of BINS equal width bins from low upwards, plus counts of values below and above them.
+        // NOTE A week holds at most 60480 aggregates of any one quantity, so each bin fits in 16 bits.
+        template <uint32_t BINS>
+        struct Distribution
+        {
+            void reset(double low_, double width_);
+            void add(double value);
+            uint32_t countWithin(double from, double to) const;
+            double percentile(double p) const;
+
+            double low;
+            double width;
+            uint32_t count;
+            uint32_t below;
+            uint32_t above;
+            uint16_t bin[BINS];
+        };
+
+        // Histograms of the aggregates of a week.
+        struct Week
+        {
+            void reset(uint32_t start_);
+            void summarise(ComplianceSummary& summary) const;
+
+            uint32_t start;                                     // Seconds since the epoch, or 0 if not begun
+            Distribution<COMPLIANCE_VOLTAGE_BINS> voltage[3];   // As a percentage of nominal
+            Distribution<COMPLIANCE_FREQUENCY_BINS> frequency;  // In Hz
+            Distribution<COMPLIANCE_UNBALANCE_BINS> unbalance;  // As a percentage
+        };
+
+        Week& weekOf(uint32_t ts);
+
+        uint32_t voltageInterval;                               // Start of the 10 minute interval being aggregated, or 0
+        uint32_t voltageCount;
+        double voltageSumSquares[3];
+        uint32_t unbalanceCount;
+        double unbalanceSumSquares;
+        uint32_t frequencyInterval;                             // Start of the 10 second interval being aggregated, or 0
+        uint32_t frequencyCount;
+        double frequencySum;
+        Week week;                                              // Week in progress
+        ComplianceSummary last;                                 // Summary of the last complete week, if any
+    };
+}
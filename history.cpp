@@ -0,0 +1,500 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>                                             // memcpy(), memset()
+
+#include <cmath>                                                // std::isfinite()
+
+#include "history.h"
+
+using namespace History;
+
+static constexpr uint32_t MAGIC = 0x4d484953;                   // "MHIS"
+static constexpr uint16_t VERSION = 1;
+static constexpr uint32_t BODY_BITS = (SEGMENT_SIZE - sizeof (SegmentHeader)) * 8;
+static constexpr uint32_t MAX_RECORD_BITS = 36 + CHANNELS * (2 + 5 + 5 + 32);
+static constexpr uint8_t NO_WINDOW = 0xff;                      // No previous non-zero XOR, so no window to reuse
+
+// Reciprocal of the resolution each channel is quantised to before compression, in the order V, I, P, Q, PF of each phase,
+// then frequency.
+static constexpr double scale[CHANNELS] = { 10.0, 100.0, 10.0, 10.0, 100.0,
+                                            10.0, 100.0, 10.0, 10.0, 100.0,
+                                            10.0, 100.0, 10.0, 10.0, 100.0,
+                                            1000.0 };
+
+static_assert(sizeof (SegmentHeader) == 64, "SegmentHeader must be 64 bytes");
+
+// Write the low n bits of value into the zeroed bitstream at the given bit position, most significant first, and advance it.
+static void writeBits(uint8_t* body, uint32_t& bit, uint64_t value, uint32_t n)
+{
+    while (n-- > 0)
+    {
+        if ((value >> n) & 1)
+            body[bit >> 3] |= 0x80 >> (bit & 7);
+        bit++;
+    }
+}
+
+// Read n bits from the bitstream at the given bit position, most significant first, and advance it.
+// Bits beyond the end of the segment read as zero.
+static uint64_t readBits(const uint8_t* body, uint32_t& bit, uint32_t n)
+{
+    uint64_t value = 0;
+    while (n-- > 0)
+    {
+        value <<= 1;
+        if (bit < BODY_BITS)
+            value |= (body[bit >> 3] >> (7 - (bit & 7))) & 1;
+        bit++;
+    }
+    return value;
+}
+
+// Append the record to the bitstream, updating the compression state.  The first record of a segment is stored uncompressed.
+static void encode(uint8_t* body, uint32_t& bit, CodecState& state, const Record& record, bool first)
+{
+    if (first)
+    {
+        writeBits(body, bit, record.ts, 32);
+        state.delta = 0;
+    }
+    else
+    {
+        int32_t delta = record.ts - state.ts;
+        int32_t dod = delta - state.delta;
+        if (dod == 0)
+        {
+            writeBits(body, bit, 0x0, 1);
+        }
+        else if (dod >= -63 && dod <= 64)
+        {
+            writeBits(body, bit, 0x2, 2);
+            writeBits(body, bit, dod + 63, 7);
+        }
+        else if (dod >= -255 && dod <= 256)
+        {
+            writeBits(body, bit, 0x6, 3);
+            writeBits(body, bit, dod + 255, 9);
+        }
+        else if (dod >= -2047 && dod <= 2048)
+        {
+            writeBits(body, bit, 0xe, 4);
+            writeBits(body, bit, dod + 2047, 12);
+        }
+        else
+        {
+            writeBits(body, bit, 0xf, 4);
+            writeBits(body, bit, (uint32_t)dod, 32);
+        }
+        state.delta = delta;
+    }
+    state.ts = record.ts;
+
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        uint32_t value;
+        memcpy(&value, &record.value[c], sizeof value);
+        if (first)
+        {
+            writeBits(body, bit, value, 32);
+            state.value[c] = value;
+            state.leading[c] = state.trailing[c] = NO_WINDOW;
+            continue;
+        }
+
+        uint32_t x = value ^ state.value[c];
+        state.value[c] = value;
+        if (x == 0)
+        {
+            writeBits(body, bit, 0x0, 1);
+            continue;
+        }
+
+        uint32_t leading = __builtin_clz(x);
+        uint32_t trailing = __builtin_ctz(x);
+        if (state.leading[c] != NO_WINDOW && leading >= state.leading[c] && trailing >= state.trailing[c])
+        {
+            // The meaningful bits fit in the previous window.
+            writeBits(body, bit, 0x2, 2);
+            writeBits(body, bit, x >> state.trailing[c], 32 - state.leading[c] - state.trailing[c]);
+        }
+        else
+        {
+            uint32_t length = 32 - leading - trailing;
+            writeBits(body, bit, 0x3, 2);
+            writeBits(body, bit, leading, 5);
+            writeBits(body, bit, length - 1, 5);
+            writeBits(body, bit, x >> trailing, length);
+            state.leading[c] = leading;
+            state.trailing[c] = trailing;
+        }
+    }
+}
+
+// Decode the next record from the bitstream, updating the compression state.  The inverse of encode().
+static void decode(const uint8_t* body, uint32_t& bit, CodecState& state, Record& record, bool first)
+{
+    if (first)
+    {
+        state.ts = readBits(body, bit, 32);
+        state.delta = 0;
+    }
+    else
+    {
+        int32_t dod;
+        if (readBits(body, bit, 1) == 0)
+            dod = 0;
+        else if (readBits(body, bit, 1) == 0)
+            dod = (int32_t)readBits(body, bit, 7) - 63;
+        else if (readBits(body, bit, 1) == 0)
+            dod = (int32_t)readBits(body, bit, 9) - 255;
+        else if (readBits(body, bit, 1) == 0)
+            dod = (int32_t)readBits(body, bit, 12) - 2047;
+        else
+            dod = (int32_t)readBits(body, bit, 32);
+        state.delta += dod;
+        state.ts += state.delta;
+    }
+    record.ts = state.ts;
+
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        if (first)
+        {
+            state.value[c] = readBits(body, bit, 32);
+            state.leading[c] = state.trailing[c] = NO_WINDOW;
+        }
+        else if (readBits(body, bit, 1) != 0)
+        {
+            if (readBits(body, bit, 1) != 0)
+            {
+                state.leading[c] = readBits(body, bit, 5);
+                uint32_t length = readBits(body, bit, 5) + 1;
+                state.trailing[c] = 32 - state.leading[c] - length;
+            }
+            uint32_t length = 32 - state.leading[c] - state.trailing[c];
+            state.value[c] ^= readBits(body, bit, length) << state.trailing[c];
+        }
+        memcpy(&record.value[c], &state.value[c], sizeof record.value[c]);
+    }
+}
+
+// Round the given value of the given channel to the resolution it is stored at.
+double History::quantise(uint32_t channel, double value)
+{
+    return std::isfinite(value) ? nearbyint(value * scale[channel]) / scale[channel] : value;
+}
+
+// Accumulate the given sample, taken at the given time in seconds since the epoch.  When the sample is the first of a new
+// minute, the average of the previous minute is written to record, timestamped with the start of that minute.
+// Returns true if a record was written.
+bool Downsampler::accumulate(uint32_t ts, const Meter::Sample& sample, Record& record)
+{
+    bool complete = false;
+    uint32_t sampleMinute = ts - ts % 60;
+
+    if (sampleMinute != minute)
+    {
+        for (uint32_t c = 0; c < CHANNELS; c++)
+        {
+            if (count[c] > 0)
+                complete = true;
+            record.value[c] = count[c] > 0 ? total[c] / count[c] : NAN;
+        }
+        record.ts = minute;
+        reset();
+        minute = sampleMinute;
+    }
+
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        double value = sample.channel(c);
+        if (std::isfinite(value))
+        {
+            total[c] += value;
+            count[c]++;
+        }
+    }
+
+    return complete;
+}
+
+// Open the store at the given path, creating or resizing it as needed, and prepare to append after its most recent record.
+// Returns false if the store cannot be mapped.
+bool Store::open(const std::string& path)
+{
+    close();
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+    if (fd < 0)
+        return false;
+
+    size_t size = (size_t)SEGMENTS * SEGMENT_SIZE;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size != size && ftruncate(fd, size) != 0))
+    {
+        close();
+        return false;
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+    base = (uint8_t*)mapping;
+
+    // Discard unrecognised segments, and find the most recently started one.
+    uint32_t maxSequence = 0;
+    for (uint32_t s = 0; s < SEGMENTS; s++)
+    {
+        SegmentHeader& h = header(s);
+        if (h.magic != MAGIC || h.version != VERSION || h.channels != CHANNELS || h.bits > BODY_BITS)
+        {
+            memset((void*)&h, 0, sizeof h);
+            continue;
+        }
+
+        if (h.sequence > maxSequence)
+        {
+            maxSequence = h.sequence;
+            active = s;
+        }
+    }
+
+    if (maxSequence == 0)
+    {
+        start(0, 1);
+        return true;
+    }
+
+    // Restore the compression state by replaying the active segment, and clear any partially written record after it.
+    SegmentHeader& h = header(active);
+    uint8_t* b = body(active);
+    uint32_t bit = 0;
+    Record record;
+    for (uint32_t i = 0; i < h.count; i++)
+        decode(b, bit, state, record, i == 0);
+
+    bit = h.bits;
+    if (bit % 8 != 0)
+        b[bit / 8] &= 0xff00 >> (bit % 8);
+    memset(b + (bit + 7) / 8, 0, BODY_BITS / 8 - (bit + 7) / 8);
+
+    return true;
+}
+
+void Store::close()
+{
+    if (base != nullptr)
+    {
+        msync(base, (size_t)SEGMENTS * SEGMENT_SIZE, MS_SYNC);
+        munmap(base, (size_t)SEGMENTS * SEGMENT_SIZE);
+        base = nullptr;
+    }
+
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+// Append the given record, which must be later than the last one, moving on to the next segment when the active one is full.
+// Returns false if the store is not open, or the record is out of order.
+bool Store::append(const Record& record)
+{
+    if (base == nullptr)
+        return false;
+
+    SegmentHeader* h = &header(active);
+    uint32_t count = h->count;
+    if (count > 0 && record.ts <= h->tsLast)
+        return false;
+
+    if (h->bits + MAX_RECORD_BITS > BODY_BITS)
+    {
+        msync(h, SEGMENT_SIZE, MS_ASYNC);
+        uint32_t sequence = h->sequence + 1;
+        active = (active + 1) % SEGMENTS;
+        start(active, sequence);
+        h = &header(active);
+        count = 0;
+    }
+
+    // Quantise each value to its channel's resolution, so that steady channels repeat exactly.
+    Record quantised;
+    quantised.ts = record.ts;
+    for (uint32_t c = 0; c < CHANNELS; c++)
+        quantised.value[c] = quantise(c, record.value[c]);
+
+    uint32_t bit = h->bits;
+    encode(body(active), bit, state, quantised, count == 0);
+
+    if (count == 0)
+        h->tsFirst = record.ts;
+    h->tsLast.store(record.ts, std::memory_order_relaxed);
+    h->bits.store(bit, std::memory_order_relaxed);
+    h->count.store(count + 1, std::memory_order_release);   // Publish the record to readers
+
+    return true;
+}
+
+// Return the time of the oldest record held, or 0 if none.
+uint32_t Store::tsFirst() const
+{
+    uint32_t ts = 0;
+    uint32_t minSequence = UINT32_MAX;
+    for (uint32_t s = 0; base != nullptr && s < SEGMENTS; s++)
+    {
+        const SegmentHeader& h = header(s);
+        if (h.sequence != 0 && h.count > 0 && h.sequence < minSequence)
+        {
+            minSequence = h.sequence;
+            ts = h.tsFirst;
+        }
+    }
+    return ts;
+}
+
+// Return the time of the most recent record held, or 0 if none.
+uint32_t Store::tsLast() const
+{
+    return base != nullptr && header(active).count > 0 ? header(active).tsLast.load() : 0;
+}
+
+// Start the given segment afresh with the given sequence number.  The sequence number is cleared first, so that any reader of
+// the segment's previous contents notices that it has been recycled.
+void Store::start(uint32_t segment, uint32_t sequence)
+{
+    SegmentHeader& h = header(segment);
+    h.sequence.store(0);
+    h.count.store(0);
+    h.bits = 0;
+    h.tsFirst = 0;
+    h.tsLast = 0;
+    memset(body(segment), 0, BODY_BITS / 8);
+    h.magic = MAGIC;
+    h.version = VERSION;
+    h.channels = CHANNELS;
+    h.sequence.store(sequence);
+}
+
+Cursor::Cursor(const Store& store_, uint32_t from_, uint32_t to_) : store(store_)
+{
+    from = from_;
+    to = to_;
+    segment = -1;
+    sequence = 0;
+    index = bit = 0;
+}
+
+// Move on to the oldest segment that follows the last one read, and may hold records within the time range.
+// Returns false if there is no such segment.
+bool Cursor::nextSegment()
+{
+    segment = -1;
+    if (store.base == nullptr)
+        return false;
+
+    uint32_t nextSequence = UINT32_MAX;
+    for (uint32_t s = 0; s < SEGMENTS; s++)
+    {
+        const SegmentHeader& h = store.header(s);
+        uint32_t seq = h.sequence.load(std::memory_order_acquire);
+        if (seq > sequence && seq < nextSequence && h.count.load(std::memory_order_acquire) > 0)
+        {
+            nextSequence = seq;
+            segment = s;
+        }
+    }
+
+    if (segment < 0)
+        return false;
+
+    const SegmentHeader& h = store.header(segment);
+    sequence = nextSequence;
+    index = bit = 0;
+    if (h.tsFirst > to)
+    {
+        segment = -1;                                           // This and all later segments are beyond the range
+        return false;
+    }
+
+    return true;
+}
+
+// Decode the next record within the time range into record.
+// Returns false once there are no more records within the range.
+bool Cursor::next(Record& record)
+{
+    while (true)
+    {
+        if (segment < 0 && !nextSegment())
+            return false;
+
+        const SegmentHeader& h = store.header(segment);
+        if (h.tsLast.load(std::memory_order_relaxed) < from || index >= h.count.load(std::memory_order_acquire))
+        {
+            segment = -1;
+            continue;
+        }
+
+        decode(store.body(segment), bit, state, record, index == 0);
+        index++;
+        if (h.sequence.load(std::memory_order_acquire) != sequence)
+        {
+            segment = -1;                                       // Recycled while we were reading it
+            continue;
+        }
+
+        if (record.ts < from)
+            continue;
+        if (record.ts > to)
+        {
+            segment = -1;
+            return false;
+        }
+
+        return true;
+    }
+}
+
+Resampler::Resampler(const Store& store, uint32_t from, uint32_t to, uint32_t resolution_) : cursor(store, from, to)
+{
+    resolution = resolution_ > 0 ? resolution_ : 1;
+    pending = cursor.next(ahead);
+}
+
+// Average the records within the next interval of the resolution that holds any, timestamped with the start of the interval.
+// Returns false once there are no more records within the range.
+bool Resampler::next(Record& record)
+{
+    if (!pending)
+        return false;
+
+    double total[CHANNELS] = {};
+    uint32_t count[CHANNELS] = {};
+    uint32_t interval = ahead.ts - ahead.ts % resolution;
+
+    while (pending && ahead.ts - ahead.ts % resolution == interval)
+    {
+        for (uint32_t c = 0; c < CHANNELS; c++)
+        {
+            if (std::isfinite(ahead.value[c]))
+            {
+                total[c] += ahead.value[c];
+                count[c]++;
+            }
+        }
+        pending = cursor.next(ahead);
+    }
+
+    record.ts = interval;
+    for (uint32_t c = 0; c < CHANNELS; c++)
+        record.value[c] = count[c] > 0 ? quantise(c, total[c] / count[c]) : NAN;
+
+    return true;
+}
@@ -0,0 +1,151 @@
+// Compressed, append-only on-device store of per-minute channel averages, in fixed size memory-mapped segments.
+//
+// Usage:
+//
+//    using namespace History;
+//    Store store;
+//    Downsampler downsampler;
+//    Record record;
+//    store.open("history.dat");
+//    while (...)
+//    {
+//        if (downsampler.accumulate(time(nullptr), sample, record))
+//            store.append(record);
+//    }
+//    Cursor cursor(store, from, to);
+//    while (cursor.next(record))
+//        ...
+//    Resampler resampler(store, from, to, 900);                  // 15 minute averages
+//    while (resampler.next(record))
+//        ...
+//
+// The store is a single file of SEGMENTS segments of SEGMENT_SIZE bytes each, used as a ring so that the oldest segment is
+// overwritten once all are full.  Each segment starts with a header holding its sequence number, record count and time range,
+// which together serve as the time index, followed by a bitstream of records compressed as in Facebook's Gorilla: timestamps as
+// delta-of-deltas, and each channel's value, quantised to its reporting resolution and stored as a float, XORed with its previous
+// value.  Steady channels thus cost a bit or two per minute, and a segment holds a day or two of history.
+//
+// Records are decoded in place from the mapping, without being copied into RAM.  A single thread may append while any number
+// of Cursors read; each segment's record count is only published once a record is complete, and a Cursor abandons a segment
+// if it is recycled under it.
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+#include "meter.h"
+
+namespace History
+{
+    static constexpr uint32_t CHANNELS = Meter::CHANNELS;
+    static constexpr uint32_t SEGMENT_SIZE = 65536;             // Bytes per segment, including its header
+    static constexpr uint32_t SEGMENTS = 32;                    // Number of segments in the store (2 MiB, or about 5 weeks)
+
+    // Timestamp, in seconds since the epoch, and the value of each channel.
+    struct Record
+    {
+        uint32_t ts;
+        float value[CHANNELS];
+    };
+
+    double quantise(uint32_t channel, double value);
+
+    // Averages samples over each minute, to produce one record per minute.
+    class Downsampler
+    {
+    public:
+        Downsampler() { minute = 0; reset(); }
+        bool accumulate(uint32_t ts, const Meter::Sample& sample, Record& record);
+        void reset() { for (uint32_t c = 0; c < CHANNELS; c++) { count[c] = 0; total[c] = 0.0; } }
+
+    private:
+        uint32_t minute;                                        // Start of the minute being averaged, in seconds since the epoch
+        uint32_t count[CHANNELS];                               // Number of finite values of each channel
+        double total[CHANNELS];
+    };
+
+    // Header at the start of each segment.
+    struct SegmentHeader
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t channels;
+        std::atomic<uint32_t> sequence;                         // Increases each time a segment is started; 0 if never used
+        std::atomic<uint32_t> count;                            // Number of complete records
+        std::atomic<uint32_t> bits;                             // Length of the bitstream holding the complete records
+        uint32_t tsFirst;                                       // Time of the first record
+        std::atomic<uint32_t> tsLast;                           // Time of the last complete record
+        uint32_t reserved[9];
+    };
+
+    // Compression state, identical in the writer and in a reader that has decoded the same records.
+    struct CodecState
+    {
+        uint32_t ts;
+        int32_t delta;
+        uint32_t value[CHANNELS];                               // Previous value of each channel, as float bits
+        uint8_t leading[CHANNELS];                              // Leading and trailing zero bits of the previous non-zero XOR
+        uint8_t trailing[CHANNELS];
+    };
+
+    class Store
+    {
+    public:
+        Store() { fd = -1; base = nullptr; active = 0; }
+        ~Store() { close(); }
+        bool open(const std::string& path);
+        void close();
+        bool isOpen() const { return base != nullptr; }
+        bool append(const Record& record);
+        uint32_t tsFirst() const;
+        uint32_t tsLast() const;
+
+    private:
+        friend class Cursor;
+
+        SegmentHeader& header(uint32_t segment) const { return *(SegmentHeader*)(base + (size_t)segment * SEGMENT_SIZE); }
+        uint8_t* body(uint32_t segment) const { return base + (size_t)segment * SEGMENT_SIZE + sizeof (SegmentHeader); }
+        void start(uint32_t segment, uint32_t sequence);
+
+        int fd;
+        uint8_t* base;                                          // Mapping of the whole store
+        uint32_t active;                                        // Segment being appended to
+        CodecState state;                                       // Writer's compression state within the active segment
+    };
+
+    // Sequential reader of the records within a time range, oldest first.
+    class Cursor
+    {
+    public:
+        Cursor(const Store& store_, uint32_t from_, uint32_t to_);
+        bool next(Record& record);
+
+    private:
+        bool nextSegment();
+
+        const Store& store;
+        uint32_t from;
+        uint32_t to;
+        int32_t segment;                                        // Segment being read, or -1 if none
+        uint32_t sequence;                                      // Sequence number of the segment being or last read
+        uint32_t index;                                         // Number of records decoded from the segment
+        uint32_t bit;                                           // Position in the segment's bitstream
+        CodecState state;
+    };
+
+    // Sequential reader of the averages of the records within each interval of a given resolution, within a time range.
+    class Resampler
+    {
+    public:
+        Resampler(const Store& store, uint32_t from, uint32_t to, uint32_t resolution_);
+        bool next(Record& record);
+
+    private:
+        Cursor cursor;
+        uint32_t resolution;                                    // Interval length, in seconds
+        Record ahead;                                           // Next record read, if pending
+        bool pending;
+    };
+}
@@ -1,5 +1,6 @@
 #include <cassert>
 #include <cmath>                                                // std::isnan()
+#include <string>
 
 #include "meter.h"
 
@@ -37,6 +38,24 @@ static double round(double n, int decimalPlaces)
     return floor(pow(10, decimalPlaces) * n) / pow(10, decimalPlaces);
 }
 
+// Retrieve the number with the given key from the JSON object into val, with null (as encoded for NaN) yielding NaN.
+// Returns false if the key is missing or is neither a number nor null.
+static bool getDouble(const nlohmann::json& j, const char* key, double& val)
+{
+    auto it = j.find(key);
+    if (it == j.end())
+        return false;
+
+    if (it->is_null())
+        val = NAN;
+    else if (it->is_number())
+        val = it->get<double>();
+    else
+        return false;
+
+    return true;
+}
+
 // Initialise the Phase with the given values.
 void Phase::set(double vrms_, double irms_, double powerActive_, double powerReactive_, double powerFactor_)
 {
@@ -47,117 +66,1558 @@ void Phase::set(double vrms_, double irms_, double powerActive_, double powerRea
     powerFactor = powerFactor_;
 }
 
-// Return true if all required members are present in the powerQualityData, false otherwise.
-bool Sample::isValid(const xsd::mtrsvc::PowerQualityData& powerQualityData)
-{
-    if (powerQualityData.voltageA.empty() || powerQualityData.currentA.empty() || powerQualityData.activePowerA.empty()
-        || powerQualityData.reactivePowerA.empty() || powerQualityData.powerFactorA.empty() || powerQualityData.voltageB.empty()
-        || powerQualityData.currentB.empty() || powerQualityData.activePowerB.empty() || powerQualityData.reactivePowerB.empty()
-        || powerQualityData.powerFactorB.empty() || powerQualityData.voltageC.empty() || powerQualityData.currentC.empty()
-        || powerQualityData.activePowerC.empty() || powerQualityData.reactivePowerC.empty() || powerQualityData.powerFactorC.empty()
-        || powerQualityData.frequency.empty())
+// Return the value of the given optional channel i, setting its bit in the validity bitmask, or NaN if it is missing or not
+// finite.
+template <typename T>
+static inline double validValue(const T& optional, uint32_t i, uint32_t& valid)
+{
+    if (optional.empty())
+        return NAN;
+
+    double value = optional.getValue();
+    if (!std::isfinite(value))
+        return NAN;
+
+    valid |= 1u << i;
+    return value;
+}
+
+// Initialise the Sample from a PowerQualityData object, in a single pass that sets each channel's validity.
+void Sample::set(const xsd::mtrsvc::PowerQualityData& powerQualityData)
+{
+    const xsd::mtrsvc::PowerQualityData& pqd = powerQualityData;
+    valid = 0;
+    p1.set(validValue(pqd.voltageA, 0, valid), validValue(pqd.currentA, 1, valid), validValue(pqd.activePowerA, 2, valid),
+           validValue(pqd.reactivePowerA, 3, valid), validValue(pqd.powerFactorA, 4, valid));
+    p2.set(validValue(pqd.voltageB, 5, valid), validValue(pqd.currentB, 6, valid), validValue(pqd.activePowerB, 7, valid),
+           validValue(pqd.reactivePowerB, 8, valid), validValue(pqd.powerFactorB, 9, valid));
+    p3.set(validValue(pqd.voltageC, 10, valid), validValue(pqd.currentC, 11, valid), validValue(pqd.activePowerC, 12, valid),
+           validValue(pqd.reactivePowerC, 13, valid), validValue(pqd.powerFactorC, 14, valid));
+    frequency = validValue(pqd.frequency, 15, valid);
+}
+
+// Initialise the Summations from the JSON encoding of a SummationData object, taking a reading of each of the given register
+// fields that is present and numeric.  Any other numbers in it, such as timestamps, multipliers and status codes, are ignored.
+// NOTE Fields beyond the first MAX_REGISTERS are ignored.
+void Summations::set(const nlohmann::json& j, const RegisterField* fields, uint32_t fieldCount)
+{
+    reset();
+    for (uint32_t f = 0; f < fieldCount && count < MAX_REGISTERS; f++)
+    {
+        // Follow the path one key at a time, e.g. "del.wh" to j["del"]["wh"].
+        const nlohmann::json* reading = &j;
+        std::string path = fields[f].path;
+        for (size_t start = 0, end = 0; reading != nullptr && end != std::string::npos; start = end + 1)
+        {
+            end = path.find('.', start);
+            auto it = reading->find(path.substr(start, end - start));   // Also end() if not an object
+            reading = it != reading->end() ? &*it : nullptr;
+        }
+        if (reading == nullptr || !reading->is_number())
+            continue;
+
+        strncpy(name[count], fields[f].path, REGISTER_NAME_LENGTH);
+        name[count][REGISTER_NAME_LENGTH] = '\0';
+        value[count] = reading->get<double>();
+        modulus[count] = fields[f].modulus;
+        count++;
+    }
+}
+
+// Return the member of the given phases or frequency holding the given measured channel, in the order of Sample::channel().
+template <typename C, typename P, typename F>
+static C& channelOf(P& p1, P& p2, P& p3, F& frequency, uint32_t i)
+{
+    static constexpr uint32_t PHASE_CHANNELS = 5;
+    P& phase = i < PHASE_CHANNELS ? p1 : i < 2 * PHASE_CHANNELS ? p2 : p3;
+
+    switch (i % PHASE_CHANNELS)
+    {
+    case 0:
+        if (i == CHANNELS - 1)
+            return frequency;
+        return phase.vrms;
+    case 1:
+        return phase.irms;
+    case 2:
+        return phase.powerActive;
+    case 3:
+        return phase.powerReactive;
+    default:
+        return phase.powerFactor;
+    }
+}
+
+// Return the value of the given measured channel, in the order V, I, P, Q, PF of phases 1, 2 and 3, then frequency.
+double Sample::channel(uint32_t i) const
+{
+    static constexpr uint32_t PHASE_CHANNELS = 5;
+    const Phase& phase = i < PHASE_CHANNELS ? p1 : i < 2 * PHASE_CHANNELS ? p2 : p3;
+
+    switch (i % PHASE_CHANNELS)
+    {
+    case 0:
+        return i == CHANNELS - 1 ? frequency : phase.vrms;
+    case 1:
+        return phase.irms;
+    case 2:
+        return phase.powerActive;
+    case 3:
+        return phase.powerReactive;
+    default:
+        return phase.powerFactor;
+    }
+}
+
+// Create a JSON "h" array encoding the histogram state.
+void Histogram::json(ordered_json& j) const
+{
+    j.clear();
+    j["h"] = { bin[0], bin[1], bin[2], bin[3], bin[4], bin[5], bin[6], bin[7], bin[8], bin[9], bin[10], bin[11] };
+}
+
+// Initialise the histogram from a JSON object containing an "h" array, as created by json().
+// Returns false if the array is missing or malformed.
+bool Histogram::set(const nlohmann::json& j)
+{
+    auto h = j.find("h");
+    if (h == j.end() || !h->is_array() || h->size() != HISTOGRAM_BINS)
+        return false;
+
+    for (uint32_t i = 0; i < HISTOGRAM_BINS; i++)
+    {
+        if (!(*h)[i].is_number_unsigned())
+            return false;
+        bin[i] = (*h)[i].get<uint32_t>();
+    }
+
+    return true;
+}
+
+// Add the other histogram's counts to this one's.
+void Histogram::merge(const Histogram& other)
+{
+    for (uint32_t i = 0; i < HISTOGRAM_BINS; i++)
+        bin[i] += other.bin[i];
+}
+
+// Create a JSON object encoding the average, minimum, maximum, and histogram, unless withHistogram is false.
+void Summary::json(ordered_json& j, bool withHistogram) const
+{
+    j.clear();
+    j["avg"] = avg;
+    j["min"] = min;
+    j["max"] = max;
+    if (withHistogram)
+        j["h"] = { histogram.bin[0], histogram.bin[1], histogram.bin[2], histogram.bin[3], histogram.bin[4], histogram.bin[5],
+                   histogram.bin[6], histogram.bin[7], histogram.bin[8], histogram.bin[9], histogram.bin[10], histogram.bin[11] };
+}
+
+// Initialise the summary from a JSON object as created by json(), with or without the histogram.
+// Returns false if any member is missing or malformed.
+bool Summary::set(const nlohmann::json& j)
+{
+    if (j.find("h") == j.end())
+        histogram.reset();
+    else if (!histogram.set(j))
+        return false;
+
+    return getDouble(j, "avg", avg) && getDouble(j, "min", min) && getDouble(j, "max", max);
+}
+
+// Merge the other summary, of otherCount values, into this one, of count values.  The average is weighted by the counts; a
+// summary with no values, or a NaN average, takes no part in it.
+void Summary::merge(const Summary& other, uint32_t count, uint32_t otherCount)
+{
+    if (count == 0 || std::isnan(avg))
+        avg = other.avg;
+    else if (otherCount > 0 && !std::isnan(other.avg))
+        avg = (avg * count + other.avg * otherCount) / (count + otherCount);
+    min = fmin(min, other.min);                                 // NOTE fmin() and fmax() ignore a NaN argument
+    max = fmax(max, other.max);
+    histogram.merge(other.histogram);
+}
+
+// Create a JSON object encoding the voltage, current, and active and reactive power, with or without their histograms.
+void PhaseSummary::json(ordered_json& j, bool withHistograms) const
+{
+    j.clear();
+    ordered_json tmp;
+    vrms.json(tmp, withHistograms);
+    j["v"] = tmp;
+    irms.json(tmp, withHistograms);
+    j["i"] = tmp;
+    powerActive.json(tmp, withHistograms);
+    j["p"] = tmp;
+    powerReactive.json(tmp, withHistograms);
+    j["q"] = tmp;
+    powerFactor.json(tmp, withHistograms);
+    j["pf"] = tmp;
+}
+
+// Initialise the phase summary from a JSON object as created by json().
+// Returns false if any member is missing or malformed.
+bool PhaseSummary::set(const nlohmann::json& j)
+{
+    if (!j.is_object() || j.find("v") == j.end() || j.find("i") == j.end() || j.find("p") == j.end() || j.find("q") == j.end()
+        || j.find("pf") == j.end())
+        return false;
+
+    return vrms.set(j["v"]) && irms.set(j["i"]) && powerActive.set(j["p"]) && powerReactive.set(j["q"])
+           && powerFactor.set(j["pf"]);
+}
+
+// Merge the other phase summary, of otherCount samples, into this one, of count samples.
+void PhaseSummary::merge(const PhaseSummary& other, uint32_t count, uint32_t otherCount)
+{
+    vrms.merge(other.vrms, count, otherCount);
+    irms.merge(other.irms, count, otherCount);
+    powerActive.merge(other.powerActive, count, otherCount);
+    powerReactive.merge(other.powerReactive, count, otherCount);
+    powerFactor.merge(other.powerFactor, count, otherCount);
+}
+
+// Create a JSON object encoding the register's name, first and last values, increase, and rollover and reset counts.
+void RegisterSummary::json(ordered_json& j) const
+{
+    j.clear();
+    j["n"] = name;
+    j["f"] = first;
+    j["l"] = last;
+    j["d"] = delta;
+    j["ro"] = rollovers;
+    j["rs"] = resets;
+}
+
+// Initialise the register summary from a JSON object as created by json().
+// Returns false if any member is missing or malformed.
+bool RegisterSummary::set(const nlohmann::json& j)
+{
+    auto n = j.find("n");
+    auto ro = j.find("ro");
+    auto rs = j.find("rs");
+    if (n == j.end() || !n->is_string() || ro == j.end() || !ro->is_number_unsigned() || rs == j.end()
+        || !rs->is_number_unsigned())
+        return false;
+
+    strncpy(name, n->get<std::string>().c_str(), REGISTER_NAME_LENGTH);
+    name[REGISTER_NAME_LENGTH] = '\0';
+    rollovers = ro->get<uint32_t>();
+    resets = rs->get<uint32_t>();
+
+    return getDouble(j, "f", first) && getDouble(j, "l", last) && getDouble(j, "d", delta);
+}
+
+// Merge the other register summary, assumed to be of the same register over a later period, into this one.
+// NOTE When merging registers of different meters, only the increase and the counts are meaningful.
+void RegisterSummary::merge(const RegisterSummary& other)
+{
+    if (std::isnan(first))
+        first = other.first;
+    if (!std::isnan(other.last))
+        last = other.last;
+    delta += other.delta;
+    rollovers += other.rollovers;
+    resets += other.resets;
+}
+
+// Create a JSON array encoding each register's summary.
+void SummationSummary::json(ordered_json& j) const
+{
+    j = json::array();
+    ordered_json tmp;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        registers[i].json(tmp);
+        j.push_back(tmp);
+    }
+}
+
+// Initialise the summation summary from a JSON array as created by json().
+// Returns false if the array is malformed.  NOTE Registers beyond the first MAX_REGISTERS are ignored.
+bool SummationSummary::set(const nlohmann::json& j)
+{
+    reset();
+    if (!j.is_array())
+        return false;
+
+    for (uint32_t i = 0; i < j.size() && count < MAX_REGISTERS; i++)
+    {
+        if (!registers[count].set(j[i]))
+            return false;
+        count++;
+    }
+
+    return true;
+}
+
+// Merge each of the other summary's registers into the register of the same name, adding any new registers.
+void SummationSummary::merge(const SummationSummary& other)
+{
+    for (uint32_t i = 0; i < other.count; i++)
+    {
+        uint32_t r;
+        for (r = 0; r < count; r++)
+        {
+            if (strcmp(registers[r].name, other.registers[i].name) == 0)
+                break;
+        }
+
+        if (r < count)
+        {
+            registers[r].merge(other.registers[i]);
+        }
+        else if (count < MAX_REGISTERS)
+        {
+            registers[count] = other.registers[i];
+            count++;
+        }
+    }
+}
+
+// Create a JSON object encoding the derived channels.
+void DerivedSummary::json(ordered_json& j, bool withHistograms) const
+{
+    static const char* const names[DERIVED_CHANNELS] = { "s1", "s2", "s3", "pt", "qt", "st", "vu", "in", "rocof" };
+
+    j.clear();
+    ordered_json tmp;
+    for (uint32_t c = 0; c < DERIVED_CHANNELS; c++)
+    {
+        channel(c).json(tmp, withHistograms);
+        j[names[c]] = tmp;
+    }
+    j["n"] = count;
+}
+
+// Initialise the derived summary from a JSON object as created by json(), of the given number of samples.  Each channel is
+// taken to summarise every sample if its count is not given, as by earlier versions.
+// Returns false if any member is missing or malformed.
+bool DerivedSummary::set(const nlohmann::json& j, uint32_t samples)
+{
+    static const char* const names[DERIVED_CHANNELS] = { "s1", "s2", "s3", "pt", "qt", "st", "vu", "in", "rocof" };
+
+    if (!j.is_object())
+        return false;
+
+    for (uint32_t c = 0; c < DERIVED_CHANNELS; c++)
+    {
+        auto it = j.find(names[c]);
+        if (it == j.end() || !channel(c).set(*it))
+            return false;
+        count[c] = samples;
+    }
+
+    auto n = j.find("n");
+    if (n != j.end())
+    {
+        if (!n->is_array() || n->size() != DERIVED_CHANNELS)
+            return false;
+        for (uint32_t c = 0; c < DERIVED_CHANNELS; c++)
+        {
+            if (!(*n)[c].is_number_unsigned())
+                return false;
+            count[c] = (*n)[c].get<uint32_t>();
+        }
+    }
+
+    return true;
+}
+
+// Merge the other derived summary into this one, weighting each channel's average by its own count.
+void DerivedSummary::merge(const DerivedSummary& other)
+{
+    for (uint32_t c = 0; c < DERIVED_CHANNELS; c++)
+    {
+        channel(c).merge(other.channel(c), count[c], other.count[c]);
+        count[c] += other.count[c];
+    }
+}
+
+// Return the summary of the given derived channel, in the order S of phases 1, 2 and 3, total P, Q and S, voltage unbalance,
+// neutral current, then ROCOF.
+Summary& DerivedSummary::channel(uint32_t i)
+{
+    switch (i)
+    {
+    case 0:
+        return powerApparent1;
+    case 1:
+        return powerApparent2;
+    case 2:
+        return powerApparent3;
+    case 3:
+        return powerActiveTotal;
+    case 4:
+        return powerReactiveTotal;
+    case 5:
+        return powerApparentTotal;
+    case 6:
+        return voltageUnbalance;
+    case 7:
+        return neutralCurrent;
+    default:
+        return rocof;
+    }
+}
+
+// Create a JSON object encoding the window length, and the peak demand and its time for each phase and in total.
+void DemandSummary::json(ordered_json& j) const
+{
+    j.clear();
+    j["w"] = window;
+    j["pk"] = { round(peak[0], 1), round(peak[1], 1), round(peak[2], 1), round(peak[3], 1) };    // NOTE NaN is encoded as null
+    j["t"] = { time[0], time[1], time[2], time[3] };
+}
+
+// Initialise the demand summary from a JSON object as created by json().
+// Returns false if any member is missing or malformed.
+bool DemandSummary::set(const nlohmann::json& j)
+{
+    reset();
+
+    auto w = j.find("w");
+    auto pk = j.find("pk");
+    auto t = j.find("t");
+    if (w == j.end() || !w->is_number_unsigned() || pk == j.end() || !pk->is_array() || pk->size() != DEMAND_CHANNELS
+        || t == j.end() || !t->is_array() || t->size() != DEMAND_CHANNELS)
+        return false;
+
+    window = w->get<uint32_t>();
+    for (uint32_t c = 0; c < DEMAND_CHANNELS; c++)
+    {
+        const nlohmann::json& p = (*pk)[c];
+        const nlohmann::json& ts = (*t)[c];
+        if (!(p.is_number() || p.is_null()) || !ts.is_number_unsigned())
+            return false;
+        peak[c] = p.is_null() ? NAN : p.get<double>();
+        time[c] = ts.get<uint32_t>();
+    }
+
+    return true;
+}
+
+// Merge the other demand summary into this one, keeping the greater peak of each channel.  Peaks over different window lengths
+// are not comparable, so a summary of a different window length is ignored.
+// NOTE The peak of the total demand of several meters may exceed the greatest of their peaks, so is not known once merged.
+void DemandSummary::merge(const DemandSummary& other)
+{
+    if (other.window == 0 || (window != 0 && other.window != window))
+        return;
+
+    window = other.window;
+    for (uint32_t c = 0; c < DEMAND_CHANNELS; c++)
+    {
+        if (std::isnan(peak[c]) || other.peak[c] > peak[c])
+        {
+            peak[c] = other.peak[c];
+            time[c] = other.time[c];
+        }
+    }
+}
+
+// Return the index into the upper triangle of the comoment matrix of the given pair of channels, in either order.
+uint32_t Covariance::index(uint32_t a, uint32_t b)
+{
+    if (a > b)
+        std::swap(a, b);
+    return a * COVARIANCE_CHANNELS - a * (a - 1) / 2 + (b - a);
+}
+
+// Accumulate the given values of the Vrms of phases 1, 2 and 3, then the active power of phases 1, 2 and 3, into each term
+// whose channels are both finite.
+void Covariance::accumulate(const double* x)
+{
+    uint32_t t = 0;
+    for (uint32_t a = 0; a < COVARIANCE_CHANNELS; a++)
+    {
+        for (uint32_t b = a; b < COVARIANCE_CHANNELS; b++, t++)
+        {
+            if (!std::isfinite(x[a]) || !std::isfinite(x[b]))
+                continue;
+
+            count[t]++;
+            double before = x[a] - meanA[t];                    // Deviation of a from its mean before this sample
+            meanA[t] += before / count[t];
+            meanB[t] += (x[b] - meanB[t]) / count[t];
+            comoment[t] += before * (x[b] - meanB[t]);          // ... times that of b after it
+        }
+    }
+}
+
+// Return the (population) covariance of the given pair of channels, or NaN if there are no samples with both valid.
+double Covariance::covariance(uint32_t a, uint32_t b) const
+{
+    uint32_t t = index(a, b);
+    return count[t] > 0 ? comoment[t] / count[t] : NAN;
+}
+
+// Return whether no term has any samples.
+bool Covariance::empty() const
+{
+    for (uint32_t t = 0; t < TERMS; t++)
+    {
+        if (count[t] > 0)
+            return false;
+    }
+
+    return true;
+}
+
+// Create a JSON object encoding the count of each term, the mean of each channel, the means of the channels of each pair, and
+// the covariance matrix, which suffice to merge summaries, followed by the sensitivity dV/dP of each phase and the correlation
+// coefficient of each pair of channels.  Terms and pairs are upper triangles by rows.
+void Covariance::json(ordered_json& j) const
+{
+    j.clear();
+    j["n"] = json::array();
+    for (uint32_t t = 0; t < TERMS; t++)
+        j["n"].push_back(count[t]);
+    j["mean"] = json::array();
+    for (uint32_t a = 0; a < COVARIANCE_CHANNELS; a++)
+        j["mean"].push_back(round(meanA[index(a, a)], 3));
+    j["pm"] = json::array();
+    for (uint32_t a = 0; a < COVARIANCE_CHANNELS; a++)
+    {
+        for (uint32_t b = a + 1; b < COVARIANCE_CHANNELS; b++)
+            j["pm"].push_back({ round(meanA[index(a, b)], 3), round(meanB[index(a, b)], 3) });
+    }
+    j["cov"] = json::array();
+    for (uint32_t a = 0; a < COVARIANCE_CHANNELS; a++)
+    {
+        for (uint32_t b = a; b < COVARIANCE_CHANNELS; b++)
+            j["cov"].push_back(covariance(a, b));               // NOTE NaN is encoded as null
+    }
+
+    j["dvdp"] = json::array();
+    for (uint32_t phase = 0; phase < 3; phase++)
+    {
+        double varP = covariance(phase + 3, phase + 3);
+        j["dvdp"].push_back(varP > 0.0 ? covariance(phase, phase + 3) / varP : NAN);
+    }
+
+    j["r"] = json::array();
+    for (uint32_t a = 0; a < COVARIANCE_CHANNELS; a++)
+    {
+        for (uint32_t b = a + 1; b < COVARIANCE_CHANNELS; b++)
+        {
+            double denominator = sqrt(covariance(a, a) * covariance(b, b));
+            j["r"].push_back(denominator > 0.0 ? round(covariance(a, b) / denominator, 4) : NAN);
+        }
+    }
+}
+
+// Initialise the covariance from a JSON object as created by json().  The slopes and correlations are not needed.
+// Returns false if any member is missing or malformed.
+bool Covariance::set(const nlohmann::json& j)
+{
+    reset();
+
+    auto n = j.find("n");
+    auto m = j.find("mean");
+    auto pm = j.find("pm");
+    auto cov = j.find("cov");
+    if (n == j.end() || !n->is_array() || n->size() != TERMS
+        || m == j.end() || !m->is_array() || m->size() != COVARIANCE_CHANNELS
+        || pm == j.end() || !pm->is_array() || pm->size() != TERMS - COVARIANCE_CHANNELS
+        || cov == j.end() || !cov->is_array() || cov->size() != TERMS)
+        return false;
+
+    uint32_t t = 0, p = 0;
+    for (uint32_t a = 0; a < COVARIANCE_CHANNELS; a++)
+    {
+        for (uint32_t b = a; b < COVARIANCE_CHANNELS; b++, t++)
+        {
+            const nlohmann::json* means = a == b ? nullptr : &(*pm)[p++];
+            if (!(*n)[t].is_number_unsigned())
+                return false;
+            count[t] = (*n)[t].get<uint32_t>();
+            if (count[t] == 0)
+                continue;                                       // NOTE The covariance of an empty term is encoded as null
+
+            if (!(*cov)[t].is_number())
+                return false;
+            comoment[t] = (*cov)[t].get<double>() * count[t];
+            if (means == nullptr)
+            {
+                if (!(*m)[a].is_number())
+                    return false;
+                meanA[t] = meanB[t] = (*m)[a].get<double>();
+            }
+            else
+            {
+                if (!means->is_array() || means->size() != 2 || !(*means)[0].is_number() || !(*means)[1].is_number())
+                    return false;
+                meanA[t] = (*means)[0].get<double>();
+                meanB[t] = (*means)[1].get<double>();
+            }
+        }
+    }
+
+    return true;
+}
+
+// Merge the other covariance into this one, as if all of its samples had been accumulated into this.
+void Covariance::merge(const Covariance& other)
+{
+    for (uint32_t t = 0; t < TERMS; t++)
+    {
+        if (other.count[t] == 0)
+            continue;
+
+        double total = (double)count[t] + other.count[t];
+        double deltaA = other.meanA[t] - meanA[t];
+        double deltaB = other.meanB[t] - meanB[t];
+        comoment[t] += other.comoment[t] + deltaA * deltaB * count[t] * other.count[t] / total;
+        meanA[t] += deltaA * other.count[t] / total;
+        meanB[t] += deltaB * other.count[t] / total;
+        count[t] += other.count[t];
+    }
+}
+
+void ComplianceSummary::reset()
+{
+    weekStart = 0;
+    for (uint32_t phase = 0; phase < 3; phase++)
+    {
+        voltageCount[phase] = 0;
+        voltageInRange[phase] = voltageP5[phase] = voltageP95[phase] = NAN;
+        voltageInLimits[phase] = true;
+    }
+    frequencyCount = unbalanceCount = 0;
+    frequencyInRange = frequencyP0_5 = frequencyP99_5 = unbalanceP95 = NAN;
+    frequencyInLimits = true;
+    pass = true;
+}
+
+// Create a JSON object encoding the week's start, and the aggregate counts, percentages within range, whether within limits and
+// percentiles of the voltage of each phase, frequency and voltage unbalance, and whether all passed.
+void ComplianceSummary::json(ordered_json& j) const
+{
+    j.clear();
+    j["wk"] = weekStart;
+    j["v"] = json::array();
+    for (uint32_t phase = 0; phase < 3; phase++)
+    {
+        j["v"].push_back({ { "n", voltageCount[phase] }, { "in", round(voltageInRange[phase], 2) },
+                           { "lim", voltageInLimits[phase] }, { "p5", round(voltageP5[phase], 2) },
+                           { "p95", round(voltageP95[phase], 2) } });
+    }
+    j["f"] = { { "n", frequencyCount }, { "in", round(frequencyInRange, 3) }, { "lim", frequencyInLimits },
+               { "p0.5", round(frequencyP0_5, 3) }, { "p99.5", round(frequencyP99_5, 3) } };
+    j["vu"] = { { "n", unbalanceCount }, { "p95", round(unbalanceP95, 2) } };
+    j["pass"] = pass;
+}
+
+#ifdef LOAD_PROFILE
+// Append the given vertex to the end of the profile.
+// Returns false, marking the profile as truncated, if the profile is full.
+bool Profile::append(uint32_t ms, float val)
+{
+    if (count < PROFILE_VERTICES)
+    {
+        time[count] = ms;
+        value[count] = val;
+        count++;
+        return true;
+    }
+
+    truncated = true;
+    return false;
+}
+
+// Create a JSON array encoding the vertices as consecutive pairs of seconds since the start of the report period and value.
+void Profile::json(ordered_json& j) const
+{
+    j = json::array();
+    for (uint32_t i = 0; i < count; i++)
+    {
+        j.push_back(round((double)time[i] / 1000, 1));
+        j.push_back(round(value[i], 1));
+    }
+}
+
+// Create a JSON object encoding each channel's profile, and whether any were truncated.
+void ProfileSummary::json(ordered_json& j) const
+{
+    static const char* const names[PROFILE_CHANNELS] = { "v1", "v2", "v3", "p1", "p2", "p3" };
+
+    j.clear();
+    ordered_json tmp;
+    bool truncated = false;
+    for (uint32_t c = 0; c < PROFILE_CHANNELS; c++)
+    {
+        channel[c].json(tmp);
+        j[names[c]] = tmp;
+        truncated |= channel[c].truncated;
+    }
+    if (truncated)
+        j["tr"] = true;
+}
+#endif
+
+#ifdef EXTREME_SAMPLES
+// Insert the extreme into the list of the given count, ordered most extreme first, if it is among the EXTREME_COUNT most extreme
+// values of the channel.  In the common case, of a value no more extreme than the last in a full list, this is a single compare.
+static void insertExtreme(Extreme* list, uint32_t& count, uint32_t channel, const Extreme& extreme, bool high)
+{
+    float val = extreme.value[channel];
+    auto moreExtreme = [high](float a, float b) { return high ? a > b : a < b; };
+    if (count == EXTREME_COUNT && !moreExtreme(val, list[count - 1].value[channel]))
+        return;
+
+    uint32_t i = count < EXTREME_COUNT ? count++ : count - 1;
+    for (; i > 0 && moreExtreme(val, list[i - 1].value[channel]); i--)
+        list[i] = list[i - 1];
+    list[i] = extreme;
+}
+
+// Consider the given sample as an extreme of the given channel.
+void Extremes::accumulate(uint32_t channel, const Extreme& extreme)
+{
+    if (!std::isfinite(extreme.value[channel]))
+        return;
+
+    insertExtreme(high, highCount, channel, extreme, true);
+    insertExtreme(low, lowCount, channel, extreme, false);
+}
+
+// Create a JSON object encoding the highest and lowest values of the given channel, each as {"v": <value>, "t": <time>,
+// "s": [<value of each channel>]}.
+void Extremes::json(ordered_json& j, uint32_t channel) const
+{
+    auto encode = [channel](const Extreme& extreme) {
+        ordered_json e;
+        e["v"] = round(extreme.value[channel], 3);
+        e["t"] = round((double)duration_cast<milliseconds>(extreme.ts.time_since_epoch()).count() / 1000, 3);
+        e["s"] = json::array();
+        for (uint32_t c = 0; c < CHANNELS; c++)
+            e["s"].push_back(round(extreme.value[c], 3));                   // NOTE NaN is encoded as null
+        return e;
+    };
+
+    j.clear();
+    j["hi"] = json::array();
+    for (uint32_t i = 0; i < highCount; i++)
+        j["hi"].push_back(encode(high[i]));
+    j["lo"] = json::array();
+    for (uint32_t i = 0; i < lowCount; i++)
+        j["lo"].push_back(encode(low[i]));
+}
+
+// Merge the other extremes of the given channel into these, keeping the most extreme of both.
+void Extremes::merge(const Extremes& other, uint32_t channel)
+{
+    for (uint32_t i = 0; i < other.highCount; i++)
+        insertExtreme(high, highCount, channel, other.high[i], true);
+    for (uint32_t i = 0; i < other.lowCount; i++)
+        insertExtreme(low, lowCount, channel, other.low[i], false);
+}
+#endif
+
+#ifdef FINE_HISTOGRAMS
+// Set the bins for the given measured channel, in the order of Sample::channel(): linear bins over 80% to 120% of the expected
+// voltage, over a power factor of -1 to 1, and over +/-3.84 Hz of the expected frequency in 10 mHz steps; otherwise log-linear
+// bins from 1/64 (A, W, var) to over 250000.
+void FineHistogram::setChannel(uint32_t channel)
+{
+    static constexpr uint32_t PHASE_CHANNELS = 5;
+    logLinear = false;
+    if (channel == CHANNELS - 1)
+    {
+        low = EXPECTED_FREQUENCY - 0.005 * FINE_BINS;
+        width = 0.01;
+    }
+    else if (channel % PHASE_CHANNELS == 0)
+    {
+        low = 0.8 * EXPECTED_VOLTAGE;
+        width = 0.4 * EXPECTED_VOLTAGE / FINE_BINS;
+    }
+    else if (channel % PHASE_CHANNELS == 4)
+    {
+        low = -1.0;
+        width = 2.0 / FINE_BINS;
+    }
+    else
+    {
+        logLinear = true;
+        low = 1.0 / 64;
+    }
+}
+
+// Count the given value, with the given weight, into its bin.
+void FineHistogram::accumulate(double val, uint32_t weight)
+{
+    if (std::isnan(val))
+        return;
+
+    double i;
+    if (!logLinear)
+    {
+        i = floor((val - low) / width);
+    }
+    else
+    {
+        // The bin of magnitudes below low is in the middle; each doubling of magnitude above it has FINE_OCTAVE_BINS bins.
+        static constexpr int64_t ZERO = FINE_BINS / 2;
+        double magnitude = fabs(val) / low;
+        int64_t j = 0;
+        if (magnitude >= 1.0)
+        {
+            int exponent;
+            double mantissa = frexp(magnitude, &exponent);      // magnitude = mantissa * 2^exponent, 0.5 <= mantissa < 1
+            j = 1 + (exponent - 1) * (int64_t)FINE_OCTAVE_BINS + (int64_t)((2.0 * mantissa - 1.0) * FINE_OCTAVE_BINS);
+        }
+        i = val < 0.0 ? ZERO - j : ZERO + j;
+    }
+
+    if (i < 0.0)
+        below += weight;
+    else if (i >= FINE_BINS)
+        above += weight;
+    else
+        bin[(uint32_t)i] += weight;
+    total += weight;
+}
+
+// Return the lower and upper bounds of the given bin.
+void FineHistogram::bounds(uint32_t i, double& lower, double& upper) const
+{
+    if (!logLinear)
+    {
+        lower = low + i * width;
+        upper = lower + width;
+        return;
+    }
+
+    static constexpr int32_t ZERO = FINE_BINS / 2;
+    int32_t j = abs((int32_t)i - ZERO);
+    if (j == 0)
+    {
+        lower = -low;
+        upper = low;
+        return;
+    }
+
+    j--;
+    double octave = ldexp(low, j / FINE_OCTAVE_BINS);
+    double from = octave * (1.0 + (double)(j % FINE_OCTAVE_BINS) / FINE_OCTAVE_BINS);
+    double to = octave * (1.0 + (double)(j % FINE_OCTAVE_BINS + 1) / FINE_OCTAVE_BINS);
+    lower = (int32_t)i > ZERO ? from : -to;
+    upper = (int32_t)i > ZERO ? to : -from;
+}
+
+// Rebin the histogram into n bins, each counting values below its boundary and at or above the previous bin's boundary, as for
+// the coarse histograms, placing each fine bin wholly in the bin containing its middle.  Values below the fine bins are counted
+// in the first bin, and those above them in the last bin unless its boundary is finite.
+void FineHistogram::rebin(const double* boundaries, uint32_t n, uint32_t* counts) const
+{
+    memset(counts, 0, n * sizeof (uint32_t));
+    if (n == 0)
+        return;
+
+    counts[0] = below;
+    uint32_t b = 0;
+    for (uint32_t i = 0; i < FINE_BINS; i++)
+    {
+        if (bin[i] == 0)
+            continue;
+
+        double lower, upper;
+        bounds(i, lower, upper);
+        double middle = (lower + upper) / 2;
+        while (b < n && middle >= boundaries[b])
+            b++;
+        if (b == n)
+            return;
+        counts[b] += bin[i];
+    }
+    if (std::isinf(boundaries[n - 1]))
+        counts[n - 1] += above;
+}
+
+// Return the given percentile of the values, interpolated within the bin it falls in, or the bound of the bins if it falls
+// below or above them, or NaN if there are no values.
+double FineHistogram::percentile(double p) const
+{
+    if (total == 0)
+        return NAN;
+
+    double lower, upper;
+    double rank = p / 100.0 * total;
+    double n = below;
+    if (rank <= n)
+    {
+        bounds(0, lower, upper);
+        return lower;
+    }
+    for (uint32_t i = 0; i < FINE_BINS; i++)
+    {
+        if (bin[i] > 0 && rank <= n + bin[i])
+        {
+            bounds(i, lower, upper);
+            return lower + (upper - lower) * (rank - n) / bin[i];
+        }
+        n += bin[i];
+    }
+
+    bounds(FINE_BINS - 1, lower, upper);
+    return upper;
+}
+
+// Create a JSON object encoding the percentiles, {"pc": [<percentile>, ...]}, and the rebinned histogram, "b", if any.
+void FineSummary::json(ordered_json& j) const
+{
+    j.clear();
+    j["pc"] = json::array();
+    for (double p : percentile)
+        j["pc"].push_back(round(p, 3));
+    if (bins > 0)
+    {
+        j["b"] = json::array();
+        for (uint32_t i = 0; i < bins; i++)
+            j["b"].push_back(bin[i]);
+    }
+}
+
+// Merge the other fine summary into this one, adding rebinned histograms of the same number of bins.
+// NOTE Percentiles cannot be merged, so become NaN.
+void FineSummary::merge(const FineSummary& other)
+{
+    for (double& p : percentile)
+        p = NAN;
+    if (bins == other.bins)
+    {
+        for (uint32_t i = 0; i < bins; i++)
+            bin[i] += other.bin[i];
+    }
+    else
+    {
+        bins = 0;
+    }
+}
+#endif
+
+// Parse a time of day given as "HH:MM", from "00:00" to "24:00", into minutes since midnight.
+// Returns false if malformed.
+bool Meter::parseTimeOfDay(const nlohmann::json& j, uint32_t& minutes)
+{
+    unsigned hours, mins;
+    char extra;
+    // NOTE %u accepts a sign, wrapping negative numbers to huge ones, so range check the hours before scaling them.
+    if (!j.is_string() || sscanf(j.get<std::string>().c_str(), "%u:%u%c", &hours, &mins, &extra) != 2 || hours > 24 || mins > 59
+        || hours * 60 + mins > 24 * 60)
+        return false;
+
+    minutes = hours * 60 + mins;
+    return true;
+}
+
+#ifdef TIME_OF_USE
+
+// Compile the calendar from a JSON object such as:
+//
+//    {"periods": ["offpeak", "shoulder", "peak"], "default": 0,
+//     "rules": [{"days": [1, 2, 3, 4, 5], "from": "07:00", "to": "21:00", "period": 1},
+//               {"days": [1, 2, 3, 4, 5], "from": "17:00", "to": "20:00", "period": 2}]}
+//
+// Every minute starts in the default period (the first, if not given), then each rule in turn assigns its period to the minutes
+// from its start time up to its end time on each of its days (0 being Sunday).  A rule ending at or before its start time runs
+// on past midnight into the following day.
+// Returns false, leaving the calendar unchanged, if any member is missing or malformed.
+bool TouCalendar::set(const nlohmann::json& j)
+{
+    static TouCalendar compiled;                                // Static, as the table is too large for the stack
+
+    auto periods = j.find("periods");
+    auto rules = j.find("rules");
+    if (!j.is_object() || periods == j.end() || !periods->is_array() || periods->empty() || periods->size() > TOU_PERIODS
+        || (rules != j.end() && !rules->is_array()))
+        return false;
+
+    compiled.count = periods->size();
+    for (uint32_t p = 0; p < compiled.count; p++)
+    {
+        const nlohmann::json& n = (*periods)[p];
+        if (!n.is_string())
+            return false;
+        strncpy(compiled.name[p], n.get<std::string>().c_str(), TOU_NAME_LENGTH);
+        compiled.name[p][TOU_NAME_LENGTH] = '\0';
+    }
+
+    auto dflt = j.find("default");
+    if (dflt != j.end() && (!dflt->is_number_unsigned() || dflt->get<uint32_t>() >= compiled.count))
+        return false;
+    memset(compiled.table, dflt != j.end() ? dflt->get<uint8_t>() : 0, sizeof compiled.table);
+
+    for (const nlohmann::json& rule : rules != j.end() ? *rules : nlohmann::json::array())
+    {
+        uint32_t from, to;
+        auto days = rule.find("days");
+        auto period = rule.find("period");
+        if (!rule.is_object() || days == rule.end() || !days->is_array() || period == rule.end()
+            || !period->is_number_unsigned() || period->get<uint32_t>() >= compiled.count
+            || rule.find("from") == rule.end() || !parseTimeOfDay(rule.at("from"), from)
+            || rule.find("to") == rule.end() || !parseTimeOfDay(rule.at("to"), to))
+            return false;
+
+        uint32_t length = to > from ? to - from : to + 24 * 60 - from;
+        for (const nlohmann::json& day : *days)
+        {
+            if (!day.is_number_unsigned() || day.get<uint32_t>() > 6)
+                return false;
+            uint32_t start = day.get<uint32_t>() * 24 * 60 + from;
+            for (uint32_t m = 0; m < length; m++)
+                compiled.table[(start + m) % MINUTES_PER_WEEK] = period->get<uint8_t>();
+        }
+    }
+
+    *this = compiled;
+    return true;
+}
+
+// Return the period that the given time falls in, looked up by its minute of the local week.
+uint32_t TouCalendar::period(time_point<system_clock> ts) const
+{
+    time_t t = system_clock::to_time_t(ts);
+    struct tm tm;
+    if (localtime_r(&t, &tm) == nullptr)
+        return 0;
+
+    return table[(tm.tm_wday * 24 + tm.tm_hour) * 60 + tm.tm_min];
+}
+
+// Create a JSON object encoding the period name, count, and voltage/current/power and frequency of the period.
+// A period without samples is encoded as just its name and count.
+void TouSummary::json(ordered_json& j) const
+{
+    j.clear();
+    j["name"] = name;
+    j["n"] = count;
+    if (count == 0)
+        return;
+
+    ordered_json tmp;
+    j["p"] = json::array();
+    p1.json(tmp);
+    j["p"][0] = tmp;
+    p2.json(tmp);
+    j["p"][1] = tmp;
+    p3.json(tmp);
+    j["p"][2] = tmp;
+    frequency.json(tmp);
+    j["f"] = tmp;
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        if (rejected[c] > 0)
+        {
+            j["rj"] = rejected;
+            break;
+        }
+    }
+}
+
+// Initialise the period summary from a JSON object as created by json().
+// Returns false if any member is missing or malformed.
+bool TouSummary::set(const nlohmann::json& j)
+{
+    reset();
+
+    auto n = j.find("name");
+    auto c = j.find("n");
+    if (!j.is_object() || n == j.end() || !n->is_string() || c == j.end() || !c->is_number_unsigned())
+        return false;
+
+    strncpy(name, n->get<std::string>().c_str(), TOU_NAME_LENGTH);
+    name[TOU_NAME_LENGTH] = '\0';
+    count = c->get<uint32_t>();
+    if (count == 0)
+        return true;
+
+    auto p = j.find("p");
+    auto f = j.find("f");
+    if (p == j.end() || !p->is_array() || p->size() != 3 || f == j.end())
+        return false;
+
+    auto rj = j.find("rj");
+    if (rj != j.end())
+    {
+        if (!rj->is_array() || rj->size() != CHANNELS)
+            return false;
+        for (uint32_t c = 0; c < CHANNELS; c++)
+        {
+            if (!(*rj)[c].is_number_unsigned())
+                return false;
+            rejected[c] = (*rj)[c].get<uint32_t>();
+        }
+    }
+
+    return p1.set((*p)[0]) && p2.set((*p)[1]) && p3.set((*p)[2]) && frequency.set(*f);
+}
+
+// Merge the other period summary, which should be of the same period, into this one.
+void TouSummary::merge(const TouSummary& other)
+{
+    if (other.count == 0)
+        return;
+
+    if (count == 0)
+    {
+        *this = other;
+        return;
+    }
+
+    // Weight each channel's average by its own valid values, as for SampleSummary::merge().
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        uint32_t valid = count > rejected[c] ? count - rejected[c] : 0;
+        uint32_t otherValid = other.count > other.rejected[c] ? other.count - other.rejected[c] : 0;
+        channel(c).merge(other.channel(c), valid, otherValid);
+        rejected[c] += other.rejected[c];
+    }
+    count += other.count;
+}
+
+// Return the summary of the given measured channel, in the order of Sample::channel().
+const Summary& TouSummary::channel(uint32_t i) const
+{
+    return channelOf<const Summary>(p1, p2, p3, frequency, i);
+}
+#endif
+
+#ifdef INTERVAL_ARRAY
+// Append the given character to the end of the array.
+bool CharArray::append(char c)
+{
+    if (index < maxEntries)
+    {
+        array[index++] = c;
+        array[index] = '\0';
+        return true;
+    }
+
+    return false;
+}
+#endif
+
+// Create a JSON object encoding the summary over the past n sample intervals.
+// A heartbeat is encoded as just {"hb":1,"n":...,"ts":...,"te":...,"z":...} plus the summation registers, if any.  A brief
+// summary, marked "br", is encoded without the histograms of the measured and derived channels, or the interval array, load
+// profile, extremes and fine histograms.
+void SampleSummary::json(ordered_json& j) const
+{
+    j.clear();
+    if (meterId[0] != '\0')
+        j["m"] = meterId;
+    if (sequence != 0)
+        j["sq"] = sequence;
+    ordered_json tmp;
+    if (heartbeat)
+    {
+        j["hb"] = 1;
+        j["n"] = count;
+        j["ts"] = duration_cast<seconds>(tsStart.time_since_epoch()).count();
+        j["te"] = duration_cast<seconds>(tsEnd.time_since_epoch()).count();
+        j["z"] = round(score, 1);
+        if (summations.count > 0)
+        {
+            summations.json(tmp);
+            j["r"] = tmp;
+        }
+        return;
+    }
+
+    if (brief)
+        j["br"] = 1;
+    j["p"] = json::array();
+    p1.json(tmp, !brief);
+    j["p"][0] = tmp;
+    p2.json(tmp, !brief);
+    j["p"][1] = tmp;
+    p3.json(tmp, !brief);
+    j["p"][2] = tmp;
+    frequency.json(tmp, !brief);
+    j["f"] = tmp;
+    derived.json(tmp, !brief);
+    j["dv"] = tmp;
+    if (summations.count > 0)
+    {
+        summations.json(tmp);
+        j["r"] = tmp;
+    }
+    if (demand.window > 0)
+    {
+        demand.json(tmp);
+        j["dm"] = tmp;
+    }
+    if (!covariance.empty())
+    {
+        covariance.json(tmp);
+        j["cv"] = tmp;
+    }
+    if (compliance.weekStart != 0)
+    {
+        compliance.json(tmp);
+        j["pq"] = tmp;
+    }
+    if (complianceLast.weekStart != 0)
+    {
+        complianceLast.json(tmp);
+        j["pql"] = tmp;
+    }
+    j["n"] = count;
+    if (sources > 0)
+        j["src"] = sources;
+    j["ts"] = duration_cast<seconds>(tsStart.time_since_epoch()).count();
+    j["te"] = duration_cast<seconds>(tsEnd.time_since_epoch()).count();
+    j["is"] = round((double)intervalMin.count() / 1000, 3);
+    j["il"] = round((double)intervalMax.count() / 1000, 3);
+    if (expectedPeriod.count() > 0)
+    {
+        j["ep"] = round((double)expectedPeriod.count() / 1000, 3);
+        j["gp"] = gaps;
+        j["gd"] = round((double)gapDuration.count() / 1000, 3);
+    }
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        if (rejected[c] > 0)
+        {
+            j["rj"] = rejected;
+            break;
+        }
+    }
+    if (duplicates > 0)
+        j["dup"] = duplicates;
+    if (late > 0)
+        j["late"] = late;
+    if (resyncs > 0)
+        j["rsy"] = resyncs;
+    if (!std::isnan(score))
+        j["z"] = round(score, 1);
+#ifdef INTERVAL_ARRAY
+    if (!brief)
+        j["i"] = interval.array;
+#endif
+#ifdef LOAD_PROFILE
+    if (!brief)
+    {
+        profile.json(tmp);
+        j["lp"] = tmp;
+    }
+#endif
+#ifdef TIME_OF_USE
+    if (touCount > 0)
+    {
+        j["tou"] = json::array();
+        for (uint32_t p = 0; p < touCount; p++)
+        {
+            tou[p].json(tmp);
+            j["tou"].push_back(tmp);
+        }
+    }
+#endif
+    if (brief)
+        return;
+#ifdef EXTREME_SAMPLES
+    j["x"] = json::array();
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        extremes[c].json(tmp, c);
+        j["x"].push_back(tmp);
+    }
+#endif
+#ifdef FINE_HISTOGRAMS
+    j["fh"] = json::array();
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        fine[c].json(tmp);
+        j["fh"].push_back(tmp);
+    }
+#endif
+}
+
+// Initialise the sample summary from a JSON object as created by json(), e.g. as received from a peer device.
+// Returns false if any member is missing or malformed, leaving the sample summary partially initialised.
+// NOTE The interval array, load profile, extremes, compliance and fine histogram summaries, if any, are not restored.
+bool SampleSummary::set(const nlohmann::json& j)
+{
+    reset();
+
+    auto p = j.find("p");
+    auto f = j.find("f");
+    auto n = j.find("n");
+    auto ts = j.find("ts");
+    auto te = j.find("te");
+    if (p == j.end() || !p->is_array() || p->size() != 3 || f == j.end() || n == j.end() || !n->is_number_unsigned()
+        || ts == j.end() || !ts->is_number_integer() || te == j.end() || !te->is_number_integer())
+        return false;
+
+    if (!p1.set((*p)[0]) || !p2.set((*p)[1]) || !p3.set((*p)[2]) || !frequency.set(*f))
+        return false;
+
+    count = n->get<uint32_t>();
+    tsStart = system_clock::from_time_t(ts->get<time_t>());
+    tsEnd = system_clock::from_time_t(te->get<time_t>());
+
+    double interval;
+    if (getDouble(j, "is", interval) && !std::isnan(interval))
+        intervalMin = milliseconds((int64_t)(interval * 1000));
+    if (getDouble(j, "il", interval) && !std::isnan(interval))
+        intervalMax = milliseconds((int64_t)(interval * 1000));
+    if (getDouble(j, "ep", interval) && !std::isnan(interval))
+        expectedPeriod = milliseconds((int64_t)(interval * 1000));
+    if (getDouble(j, "gd", interval) && !std::isnan(interval))
+        gapDuration = milliseconds((int64_t)(interval * 1000));
+    auto gp = j.find("gp");
+    if (gp != j.end() && gp->is_number_unsigned())
+        gaps = gp->get<uint32_t>();
+    auto rj = j.find("rj");
+    if (rj != j.end())
+    {
+        if (!rj->is_array() || rj->size() != CHANNELS)
+            return false;
+        for (uint32_t c = 0; c < CHANNELS; c++)
+        {
+            if (!(*rj)[c].is_number_unsigned())
+                return false;
+            rejected[c] = (*rj)[c].get<uint32_t>();
+        }
+    }
+    auto dup = j.find("dup");
+    if (dup != j.end() && dup->is_number_unsigned())
+        duplicates = dup->get<uint32_t>();
+    auto lt = j.find("late");
+    if (lt != j.end() && lt->is_number_unsigned())
+        late = lt->get<uint32_t>();
+    auto rsy = j.find("rsy");
+    if (rsy != j.end() && rsy->is_number_unsigned())
+        resyncs = rsy->get<uint32_t>();
+
+    auto r = j.find("r");
+    if (r != j.end() && !summations.set(*r))
+        return false;
+
+    auto dv = j.find("dv");
+    if (dv != j.end() && !derived.set(*dv, count))
+        return false;
+
+    auto cv = j.find("cv");
+    if (cv != j.end() && !covariance.set(*cv))
+        return false;
+
+    auto dm = j.find("dm");
+    if (dm != j.end() && !demand.set(*dm))
         return false;
 
+#ifdef TIME_OF_USE
+    auto t = j.find("tou");
+    if (t != j.end())
+    {
+        if (!t->is_array() || t->size() > TOU_PERIODS)
+            return false;
+        for (touCount = 0; touCount < t->size(); touCount++)
+        {
+            if (!tou[touCount].set((*t)[touCount]))
+                return false;
+        }
+    }
+#endif
+
+    auto src = j.find("src");
+    if (src != j.end() && src->is_number_unsigned())
+        sources = src->get<uint32_t>();
+    brief = j.find("br") != j.end();
+
+    auto m = j.find("m");
+    if (m != j.end() && m->is_string())
+    {
+        strncpy(meterId, m->get<std::string>().c_str(), METER_ID_LENGTH);
+        meterId[METER_ID_LENGTH] = '\0';
+    }
+
     return true;
 }
 
-// Initialise the Sample from a PowerQualityData object.
-void Sample::set(const xsd::mtrsvc::PowerQualityData& powerQualityData)
+// Merge the other sample summary into this one, combining averages weighted by their sample counts, extremes, histograms,
+// and time spans.  Each merged summary counts as a source, or as its own number of sources if it is itself an aggregate.
+void SampleSummary::merge(const SampleSummary& other)
 {
-    p1.set(powerQualityData.voltageA.getValue(), powerQualityData.currentA.getValue(), powerQualityData.activePowerA.getValue(),
-           powerQualityData.reactivePowerA.getValue(), powerQualityData.powerFactorA.getValue());
-    p2.set(powerQualityData.voltageB.getValue(), powerQualityData.currentB.getValue(), powerQualityData.activePowerB.getValue(),
-           powerQualityData.reactivePowerB.getValue(), powerQualityData.powerFactorB.getValue());
-    p3.set(powerQualityData.voltageC.getValue(), powerQualityData.currentC.getValue(), powerQualityData.activePowerC.getValue(),
-           powerQualityData.reactivePowerC.getValue(), powerQualityData.powerFactorC.getValue());
-    frequency = powerQualityData.frequency.getValue();
+    if (other.count == 0)
+        return;
+
+#ifdef LOAD_PROFILE
+    // Profiles are only meaningful when merging consecutive summaries of the same meter, in which case they are concatenated.
+    if (count == 0)
+    {
+        profile = other.profile;
+    }
+    else if (other.tsStart >= tsEnd && strcmp(meterId, other.meterId) == 0)
+    {
+        uint32_t offset = duration_cast<milliseconds>(other.tsStart - tsStart).count();
+        for (uint32_t c = 0; c < PROFILE_CHANNELS; c++)
+        {
+            const Profile& from = other.profile.channel[c];
+            Profile& to = profile.channel[c];
+            for (uint32_t i = 0; i < from.count; i++)
+                to.append(from.time[i] + offset, from.value[i]);
+            to.truncated |= from.truncated;
+        }
+    }
+    else
+    {
+        profile.reset();
+    }
+#endif
+
+    if (count == 0)
+    {
+        tsStart = other.tsStart;
+        tsEnd = other.tsEnd;
+    }
+    else
+    {
+        if (other.tsStart < tsStart)
+            tsStart = other.tsStart;
+        if (other.tsEnd > tsEnd)
+            tsEnd = other.tsEnd;
+    }
+
+#ifdef EXTREME_SAMPLES
+    for (uint32_t c = 0; c < CHANNELS; c++)
+        extremes[c].merge(other.extremes[c], c);
+#endif
+#ifdef FINE_HISTOGRAMS
+    for (uint32_t c = 0; c < CHANNELS; c++)
+        fine[c].merge(other.fine[c]);
+#endif
+#ifdef TIME_OF_USE
+    // Merge periods by name, adding any new ones while there is room.
+    for (uint32_t i = 0; i < other.touCount; i++)
+    {
+        uint32_t p;
+        for (p = 0; p < touCount; p++)
+        {
+            if (strcmp(tou[p].name, other.tou[i].name) == 0)
+                break;
+        }
+
+        if (p < touCount)
+        {
+            tou[p].merge(other.tou[i]);
+        }
+        else if (touCount < TOU_PERIODS)
+        {
+            tou[touCount] = other.tou[i];
+            touCount++;
+        }
+    }
+#endif
+
+    // Weight each measured channel's average by its own valid values, since its missing and invalid values were not averaged.
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        uint32_t valid = count > rejected[c] ? count - rejected[c] : 0;
+        uint32_t otherValid = other.count > other.rejected[c] ? other.count - other.rejected[c] : 0;
+        channel(c).merge(other.channel(c), valid, otherValid);
+    }
+    derived.merge(other.derived);
+    summations.merge(other.summations);
+    demand.merge(other.demand);
+    covariance.merge(other.covariance);
+    if (other.intervalMin < intervalMin)
+        intervalMin = other.intervalMin;
+    if (other.intervalMax > intervalMax)
+        intervalMax = other.intervalMax;
+    if (other.expectedPeriod > expectedPeriod)
+        expectedPeriod = other.expectedPeriod;
+    gaps += other.gaps;
+    gapDuration += other.gapDuration;
+    duplicates += other.duplicates;
+    for (uint32_t c = 0; c < CHANNELS; c++)
+        rejected[c] += other.rejected[c];
+    late += other.late;
+    resyncs += other.resyncs;
+    brief = brief || other.brief;                               // The merged histograms lack the brief summary's values
+    count += other.count;
+    sources += other.sources > 0 ? other.sources : 1;
 }
 
-// Create a JSON "h" array encoding the histogram state.
-void Histogram::json(ordered_json& j) const
+// Return the summary of the given measured channel, in the order V, I, P, Q, PF of phases 1, 2 and 3, then frequency.
+const Summary& SampleSummary::channel(uint32_t i) const
 {
-    j.clear();
-    j["h"] = { bin[0], bin[1], bin[2], bin[3], bin[4], bin[5], bin[6], bin[7], bin[8], bin[9], bin[10], bin[11] };
+    return channelOf<const Summary>(p1, p2, p3, frequency, i);
 }
 
-// Create a JSON object encoding the average, minimum, maximum, and histogram.
-void Summary::json(ordered_json& j) const
+// Accumulate the given sample.
+bool Report::accumulate(const Sample& sample)
 {
-    j.clear();
-    j["avg"] = avg;
-    j["min"] = min;
-    j["max"] = max;
-    j["h"] = { histogram.bin[0], histogram.bin[1], histogram.bin[2], histogram.bin[3], histogram.bin[4], histogram.bin[5],
-               histogram.bin[6], histogram.bin[7], histogram.bin[8], histogram.bin[9], histogram.bin[10], histogram.bin[11] };
+    return acc.accumulate(sample);
 }
 
-// Create a JSON object encoding the voltage, current, and active and reactive power.
-void PhaseSummary::json(ordered_json& j) const
+// Summarise all accumulated samples into the given sample summary.
+bool Report::summarise(SampleSummary& sampleSummary)
 {
-    j.clear();
-    ordered_json tmp;
-    vrms.json(tmp);
-    j["v"] = tmp;
-    irms.json(tmp);
-    j["i"] = tmp;
-    powerActive.json(tmp);
-    j["p"] = tmp;
-    powerReactive.json(tmp);
-    j["q"] = tmp;
-    powerFactor.json(tmp);
-    j["pf"] = tmp;
+    return acc.summarise(sampleSummary);
 }
 
-#ifdef INTERVAL_ARRAY
-// Append the given character to the end of the array.
-bool CharArray::append(char c)
+// Accumulate the given summation register readings.
+bool Report::accumulate(const Summations& summations)
 {
-    if (index < maxEntries)
-    {
-        array[index++] = c;
-        array[index] = '\0';
-        return true;
-    }
+    return acc.summations.accumulate(summations);
+}
 
-    return false;
+#ifdef LOAD_PROFILE
+// Set the maximum deviation of the Vrms and active power profiles from the samples, taking effect from the next report period.
+void Report::setProfileTolerance(double vrms, double powerActive)
+{
+    for (uint32_t c = 0; c < PROFILE_CHANNELS; c++)
+        acc.profile[c].toleranceNext = c < 3 ? vrms : powerActive;
 }
 #endif
 
-// Create a JSON object encoding the summary over the past n sample intervals.
-void SampleSummary::json(ordered_json& j) const
+// Set the expected interval between samples, against which gaps are detected, or 0 if unknown.
+void Report::setExpectedPeriod(milliseconds period)
 {
-    j.clear();
-    j["p"] = json::array();
-    ordered_json tmp;
-    p1.json(tmp);
-    j["p"][0] = tmp;
-    p2.json(tmp);
-    j["p"][1] = tmp;
-    p3.json(tmp);
-    j["p"][2] = tmp;
-    frequency.json(tmp);
-    j["f"] = tmp;
-    j["n"] = count;
-    j["ts"] = duration_cast<seconds>(tsStart.time_since_epoch()).count();
-    j["te"] = duration_cast<seconds>(tsEnd.time_since_epoch()).count();
-    j["is"] = round((double)intervalMin.count() / 1000, 3);
-    j["il"] = round((double)intervalMax.count() / 1000, 3);
-#ifdef INTERVAL_ARRAY
-    j["i"] = interval.array;
-#endif
+    acc.expectedPeriod = period;
 }
 
-// Accumulate the given sample.
-bool Report::accumulate(const Sample& sample)
+// Set the demand window, in minutes, restarting the demand calculation.
+void Report::setDemandWindow(uint32_t minutes)
 {
-    return acc.accumulate(sample);
+    acc.demand.window = minutes < 1 ? 1 : minutes > DEMAND_WINDOW_MAX ? DEMAND_WINDOW_MAX : minutes;
+    acc.demand.restart();
 }
 
-// Summarise all accumulated samples into the given sample summary.
-bool Report::summarise(SampleSummary& sampleSummary)
+#ifdef TIME_OF_USE
+// Route each subsequent sample to the accumulator of its time-of-use period in the given calendar, or none if nullptr.
+// The period accumulators are reset, as the periods may have changed.
+void Report::setCalendar(const TouCalendar* calendar)
 {
-    return acc.summarise(sampleSummary);
+    acc.calendar = calendar;
+    for (TouAccumulator& t : acc.tou)
+        t.reset();
+}
+#endif
+
+#ifdef FINE_HISTOGRAMS
+// Rebin the given channel's fine histogram into the given n boundaries at each report, as for the coarse histograms, or not at
+// all if n is 0.
+// Returns false if there are too many boundaries, or they are not ascending.
+bool Report::setRebinning(uint32_t channel, const double* boundaries, uint32_t n)
+{
+    if (channel >= CHANNELS || n > FINE_REBIN_MAX)
+        return false;
+    for (uint32_t i = 1; i < n; i++)
+    {
+        if (!(boundaries[i] > boundaries[i - 1]))
+            return false;
+    }
+
+    memcpy(acc.rebinBoundary[channel], boundaries, n * sizeof (double));
+    acc.rebinCount[channel] = n;
+    return true;
 }
+#endif
 
 uint32_t Report::count()
 {
@@ -169,8 +1629,8 @@ void Report::reset()
     acc.reset();
 }
 
-// Accumulate the given value into the total, min and/or max if appropriate, and histogram.
-bool Report::Accumulator::accumulate(const double val)
+// Accumulate the given value with the given weight into the total, min and/or max if appropriate, and histogram.
+bool Report::Accumulator::accumulate(const double val, uint32_t weight_)
 {
     if (binBoundaryPtr == nullptr)
     {
@@ -187,8 +1647,9 @@ bool Report::Accumulator::accumulate(const double val)
 
     if (bin < HISTOGRAM_BINS)
     {
-        histogram.bin[bin]++;
-        total += val;
+        histogram.bin[bin] += weight_;
+        total.add(val * weight_);
+        weight += weight_;
         if (val < min || std::isnan(min))
             min = val;
         if (val > max || std::isnan(max))
@@ -209,30 +1670,13 @@ bool Report::Accumulator::summarise(Summary& summary, uint32_t count) const
         return false;
     }
 
-    summary.avg = round(total / count, decimalPlaces);
+    summary.avg = round(weight > 0.0 ? total.value() / weight : NAN, decimalPlaces);
     summary.min = round(min, decimalPlaces);
     summary.max = round(max, decimalPlaces);
 
     return true;
 }
 
-// Accumulate the given phase point-in-time data.
-// Returns true if all components were successfully added, false if at least one failed.
-bool Report::PhaseAccumulator::accumulate(const Phase& phase)
-{
-    bool successV = vrms.accumulate(phase.vrms);
-    bool successI = irms.accumulate(phase.irms);
-    bool successP = powerActive.accumulate(phase.powerActive);
-    bool successQ = powerReactive.accumulate(phase.powerReactive);
-    bool successF = powerFactor.accumulate(phase.powerFactor);
-
-    if (successV && successI && successP && successQ && successF)
-        return true;
-
-    assert(false);
-    return false;
-}
-
 // Summarise the accumulated phase values over the given number of samples into the provided phase summary.
 bool Report::PhaseAccumulator::summarise(PhaseSummary& phaseSummary, uint32_t count) const
 {
@@ -249,55 +1693,558 @@ bool Report::PhaseAccumulator::summarise(PhaseSummary& phaseSummary, uint32_t co
     return false;
 }
 
-// Accumulate the given all-phase point-in-time data, and increment the count (unless all the accumulations failed).
-// Returns true if all components were successfully added, false if at least one failed.
+// Accumulate the given register reading, detecting the register rolling over past the given modulus, i.e. falling from within
+// REGISTER_ROLLOVER_MARGIN of it to within that margin of 0, or otherwise being reset.  A register with a modulus of 0 is taken
+// never to roll over.  A reset register is assumed to have restarted from zero.
+void Report::RegisterAccumulator::accumulate(const double val, const double modulus)
+{
+    if (!std::isfinite(val))
+        return;
+
+    if (std::isnan(last))
+    {
+        first = val;                                            // First reading of this register
+    }
+    else if (val >= last)
+    {
+        delta += val - last;
+    }
+    else if (modulus > 0.0 && last >= (1.0 - REGISTER_ROLLOVER_MARGIN) * modulus && val < REGISTER_ROLLOVER_MARGIN * modulus)
+    {
+        delta += modulus - last + val;
+        rollovers++;
+    }
+    else
+    {
+        delta += val;
+        resets++;
+    }
+
+    last = val;
+}
+
+// Summarise the accumulated register readings into the provided register summary.
+void Report::RegisterAccumulator::summarise(RegisterSummary& summary) const
+{
+    memcpy(summary.name, name, sizeof name);
+    summary.first = first;
+    summary.last = last;
+    summary.delta = delta;
+    summary.rollovers = rollovers;
+    summary.resets = resets;
+}
+
+// Accumulate each of the given register readings into the register of the same name, adding any new registers.
+// Returns false if any reading was dropped because MAX_REGISTERS registers are already being accumulated.
+bool Report::SummationAccumulator::accumulate(const Summations& summations)
+{
+    bool success = true;
+
+    for (uint32_t i = 0; i < summations.count; i++)
+    {
+        uint32_t r;
+        for (r = 0; r < count; r++)
+        {
+            if (strcmp(registers[r].name, summations.name[i]) == 0)
+                break;
+        }
+
+        if (r == count)
+        {
+            if (count == MAX_REGISTERS)
+            {
+                success = false;
+                continue;
+            }
+
+            memcpy(registers[r].name, summations.name[i], sizeof registers[r].name);
+            count++;
+        }
+
+        registers[r].accumulate(summations.value[i], summations.modulus[i]);
+    }
+
+    return success;
+}
+
+// Summarise all accumulated registers into the provided summation summary.
+void Report::SummationAccumulator::summarise(SummationSummary& summary) const
+{
+    for (uint32_t r = 0; r < count; r++)
+        registers[r].summarise(summary.registers[r]);
+    summary.count = count;
+}
+
+// Compute the derived quantities of the given sample, taken at the given time, and accumulate those that are finite.
+// The quantities are computed together, without branches, so that the compiler may vectorise the per-phase arithmetic.
+void Report::DerivedAccumulator::accumulate(const Sample& sample, time_point<system_clock> ts)
+{
+    static constexpr double SIN_120 = 0.86602540378443865;     // sin(120 degrees)
+    const Phase* phases[3] = { &sample.p1, &sample.p2, &sample.p3 };
+    double val[DERIVED_CHANNELS];
+
+    // Apparent power, and the current phasor, taking each phase voltage as the reference for its phase: the current lags by
+    // the power factor angle, so its in-phase and quadrature components are proportional to P and -Q.  The phasor needs the
+    // phase's I, P and Q (channels 1 to 3 of its 5) to be valid, as a missing P or Q would otherwise pass for no current.
+    static constexpr uint32_t PHASOR_VALID = 0x0e;
+    double re[3], im[3];
+    double vTotal = 0.0;
+    bool phasorsValid = true;
+    for (uint32_t k = 0; k < 3; k++)
+    {
+        const Phase& p = *phases[k];
+        phasorsValid &= (sample.valid >> (5 * k) & PHASOR_VALID) == PHASOR_VALID;
+        double s = sqrt(p.powerActive * p.powerActive + p.powerReactive * p.powerReactive);
+        val[k] = p.vrms * p.irms;
+        re[k] = s > 0.0 ? p.irms * p.powerActive / s : 0.0;
+        im[k] = s > 0.0 ? -p.irms * p.powerReactive / s : 0.0;
+        vTotal += p.vrms;
+    }
+
+    // Totals, with the total apparent power as the magnitude of the total complex power.
+    val[3] = sample.p1.powerActive + sample.p2.powerActive + sample.p3.powerActive;
+    val[4] = sample.p1.powerReactive + sample.p2.powerReactive + sample.p3.powerReactive;
+    val[5] = sqrt(val[3] * val[3] + val[4] * val[4]);
+
+    // Voltage unbalance, as the greatest deviation from the average as a percentage of the average (NEMA MG 1).
+    double vAvg = vTotal / 3;
+    double deviation = fmax(fabs(sample.p1.vrms - vAvg), fmax(fabs(sample.p2.vrms - vAvg), fabs(sample.p3.vrms - vAvg)));
+    bool threePhase = sample.p1.vrms > 0.0 && sample.p2.vrms > 0.0 && sample.p3.vrms > 0.0;
+    val[6] = threePhase ? 100.0 * deviation / vAvg : NAN;
+
+    // Neutral current, rotating phases 2 and 3 by -120 and +120 degrees respectively.
+    double inRe = re[0] + (-0.5 * re[1] + SIN_120 * im[1]) + (-0.5 * re[2] - SIN_120 * im[2]);
+    double inIm = im[0] + (-0.5 * im[1] - SIN_120 * re[1]) + (-0.5 * im[2] + SIN_120 * re[2]);
+    val[7] = phasorsValid ? sqrt(inRe * inRe + inIm * inIm) : NAN;
+
+    // Rate of change of frequency since the last sample, if recent enough.
+    double interval = duration_cast<milliseconds>(ts - tsLast).count() / 1000.0;
+    val[8] = interval > 0.0 && interval <= ROCOF_INTERVAL_MAX ? (sample.frequency - frequencyLast) / interval : NAN;
+    frequencyLast = sample.frequency;
+    tsLast = ts;
+
+    for (uint32_t c = 0; c < DERIVED_CHANNELS; c++)
+    {
+        if (std::isfinite(val[c]) && channel(c).accumulate(val[c]))
+            count[c]++;
+    }
+}
+
+// Summarise the derived quantities into the provided summary.  A channel with no values has a NaN average.
+bool Report::DerivedAccumulator::summarise(DerivedSummary& summary) const
+{
+    bool success = true;
+    for (uint32_t c = 0; c < DERIVED_CHANNELS; c++)
+    {
+        summary.count[c] = count[c];
+        if (count[c] > 0)
+        {
+            success &= channel(c).summarise(summary.channel(c), count[c]);
+        }
+        else
+        {
+            summary.channel(c).reset();
+            summary.channel(c).avg = NAN;
+        }
+    }
+
+    return success;
+}
+
+// Return the accumulator of the given derived channel, in the order of DerivedSummary::channel().
+Report::Accumulator& Report::DerivedAccumulator::channel(uint32_t i)
+{
+    switch (i)
+    {
+    case 0:
+        return powerApparent1;
+    case 1:
+        return powerApparent2;
+    case 2:
+        return powerApparent3;
+    case 3:
+        return powerActiveTotal;
+    case 4:
+        return powerReactiveTotal;
+    case 5:
+        return powerApparentTotal;
+    case 6:
+        return voltageUnbalance;
+    case 7:
+        return neutralCurrent;
+    default:
+        return rocof;
+    }
+}
+
+#ifdef TIME_OF_USE
+// Accumulate the given sample, with the given weight as for SampleAccumulator, into the time-of-use period's statistics, so
+// that they agree with the report's own.  Each channel's average is over its own valid values, so the sample is counted even
+// if some channels are invalid.
+// Returns false if no channel was valid.
+bool Report::TouAccumulator::accumulate(const Sample& sample, uint32_t weight)
+{
+    bool accumulated = false;
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        if (sample.isValid(c) && channel(c).accumulate(sample.channel(c), weight))
+            accumulated = true;
+        else
+            rejected[c]++;
+    }
+    if (accumulated)
+        count++;
+
+    return accumulated;
+}
+
+// Return the accumulator of the given measured channel, in the order of Sample::channel().
+Report::Accumulator& Report::TouAccumulator::channel(uint32_t i)
+{
+    return channelOf<Accumulator>(p1, p2, p3, frequency, i);
+}
+
+// Summarise the time-of-use period's statistics into the provided summary, leaving the summary reset if there are no samples.
+bool Report::TouAccumulator::summarise(TouSummary& summary) const
+{
+    summary.reset();
+    summary.count = count;
+    if (count == 0)
+        return true;
+
+    memcpy(summary.rejected, rejected, sizeof rejected);
+
+    return p1.summarise(summary.p1, count) && p2.summarise(summary.p2, count) && p3.summarise(summary.p3, count)
+           && frequency.summarise(summary.frequency, count);
+}
+#endif
+
+// Accumulate the active power of the given sample, taken at the given time in seconds since the epoch.
+void Report::DemandAccumulator::accumulate(uint32_t ts, const Sample& sample)
+{
+    double power[DEMAND_CHANNELS] = { sample.p1.powerActive, sample.p2.powerActive, sample.p3.powerActive, 0.0 };
+    uint32_t valid = 0;
+    for (uint32_t c = 0; c < DEMAND_CHANNELS - 1; c++)
+    {
+        if (std::isfinite(power[c]))
+        {
+            power[DEMAND_CHANNELS - 1] += power[c];
+            valid++;
+        }
+    }
+    if (valid == 0)
+        return;
+
+    uint32_t sampleMinute = ts / 60;
+    if (sampleMinute != minute)
+    {
+        // Complete the minute, and if the window now holds consecutive minutes throughout, compare its average with the peak.
+        // The total is valid in every minute with samples, so its count tells whether the minute had any.
+        if (count[DEMAND_CHANNELS - 1] > 0)
+        {
+            if (minute == minuteLast + 1)
+                filled = filled < window ? filled + 1 : window;
+            else
+                filled = 1;
+            minuteLast = minute;
+            for (uint32_t c = 0; c < DEMAND_CHANNELS; c++)
+                average[minute % window][c] = count[c] > 0 ? total[c] / count[c] : NAN;
+
+            if (filled == window)
+            {
+                for (uint32_t c = 0; c < DEMAND_CHANNELS; c++)
+                {
+                    double demand = 0.0;
+                    for (uint32_t i = 0; i < window; i++)
+                        demand += average[i][c];
+                    demand /= window;
+                    if (!std::isnan(demand) && (std::isnan(peak[c]) || demand > peak[c]))
+                    {
+                        peak[c] = demand;
+                        time[c] = (minute + 1) * 60;
+                    }
+                }
+            }
+        }
+
+        minute = sampleMinute;
+        for (uint32_t c = 0; c < DEMAND_CHANNELS; c++)
+        {
+            count[c] = 0;
+            total[c] = 0.0;
+        }
+    }
+
+    for (uint32_t c = 0; c < DEMAND_CHANNELS; c++)
+    {
+        if (std::isfinite(power[c]))
+        {
+            total[c] += power[c];
+            count[c]++;
+        }
+    }
+}
+
+void Report::DemandAccumulator::summarise(DemandSummary& summary) const
+{
+    summary.window = window;
+    for (uint32_t c = 0; c < DEMAND_CHANNELS; c++)
+    {
+        summary.peak[c] = peak[c];
+        summary.time[c] = time[c];
+    }
+}
+
+// Discard the window and the minute being averaged, as well as the peak, e.g. on changing the window length.
+void Report::DemandAccumulator::restart()
+{
+    minute = minuteLast = 0;
+    filled = 0;
+    for (uint32_t c = 0; c < DEMAND_CHANNELS; c++)
+    {
+        count[c] = 0;
+        total[c] = 0.0;
+    }
+    reset();
+}
+
+#ifdef LOAD_PROFILE
+// Accumulate the given value, sampled at the given time since the start of the report period, emitting the held sample as a
+// vertex if the new value can no longer be reached by a line from the last vertex that stays within the tolerance.
+// To guarantee the tolerance, the emitted vertex is placed mid-way between the doors, rather than exactly at the held sample.
+void Report::SwingingDoor::accumulate(uint32_t ms, double val)
+{
+    if (!std::isfinite(val))
+        return;
+
+    if (!started)
+    {
+        profile.append(ms, val);
+        msVertex = msHeld = ms;
+        valVertex = valHeld = val;
+        slopeUpper = HUGE_VAL;
+        slopeLower = -HUGE_VAL;
+        started = true;
+        return;
+    }
+
+    if (ms <= msHeld)
+        return;
+
+    double dt = ms - msVertex;
+    double upper = (val + tolerance - valVertex) / dt;
+    double lower = (val - tolerance - valVertex) / dt;
+    if (fmax(lower, slopeLower) > fmin(upper, slopeUpper))
+    {
+        valVertex += (slopeUpper + slopeLower) / 2 * (msHeld - msVertex);
+        msVertex = msHeld;
+        profile.append(msVertex, valVertex);
+
+        dt = ms - msVertex;
+        slopeUpper = (val + tolerance - valVertex) / dt;
+        slopeLower = (val - tolerance - valVertex) / dt;
+    }
+    else
+    {
+        slopeUpper = fmin(upper, slopeUpper);
+        slopeLower = fmax(lower, slopeLower);
+    }
+
+    msHeld = ms;
+    valHeld = val;
+}
+
+// Summarise the vertices emitted so far into the provided profile, finishing with a vertex for the held sample.
+void Report::SwingingDoor::summarise(Profile& summary) const
+{
+    summary = profile;
+    if (started && msHeld > msVertex)
+        summary.append(msHeld, valVertex + (slopeUpper + slopeLower) / 2 * (msHeld - msVertex));
+}
+#endif
+
+// Accumulate the given all-phase point-in-time data, as of the time it was read if known, or else now, and increment the count
+// (unless no channel was valid).
+// Returns false if no channel was valid, in which case the sample is ignored other than counting its channels as rejected.
 bool Report::SampleAccumulator::accumulate(const Sample& sample)
 {
-    bool successP1 = p1.accumulate(sample.p1);
-    bool successP2 = p2.accumulate(sample.p2);
-    bool successP3 = p3.accumulate(sample.p3);
-    bool successF = frequency.accumulate(sample.frequency);
+    time_point<system_clock> ts = sample.ts != system_clock::from_time_t(0) ? sample.ts : system_clock::now();
+    milliseconds intervalLast = duration_cast<milliseconds>(ts - tsLast);
+#ifdef DURATION_WEIGHTED
+    // Weight by the interval since the last sample, up to the expected period; the first sample has only the expected period.
+    milliseconds held = !sampled ? expectedPeriod : expectedPeriod.count() > 0 && intervalLast > expectedPeriod ? expectedPeriod
+                      : intervalLast;
+    uint32_t weight = held.count() > 0 ? (uint32_t)held.count() : 1;
+#else
+    uint32_t weight = 1;
+#endif
+
+    // Accumulate each valid channel, rejecting those that are missing, not finite, or beyond the histogram's range.
+    bool accumulated = false;
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        if (sample.isValid(c) && channels.accumulate(c, sample.channel(c), weight))
+        {
+            accumulated = true;
+#ifdef FINE_HISTOGRAMS
+            fine[c].accumulate(sample.channel(c), weight);
+#endif
+        }
+        else
+        {
+            rejected[c]++;
+        }
+    }
 
-    if (successP1 && successP2 && successP3 && successF)
+    if (accumulated)
     {
         count++;
-        tsEnd = system_clock::now();
-        milliseconds intervalLast = duration_cast<milliseconds>(tsEnd - tsLast);
+        tsEnd = ts;
         if (intervalLast < intervalMin)
             intervalMin = intervalLast;
         if (intervalLast > intervalMax)
             intervalMax = intervalLast;
+        if (sampled && expectedPeriod.count() > 0 && intervalLast > duration_cast<milliseconds>(expectedPeriod * GAP_FACTOR))
+        {
+            gaps++;
+            gapDuration += intervalLast - expectedPeriod;
+        }
 #ifdef INTERVAL_ARRAY
         interval.append(msToBase64(intervalLast.count()));
+#endif
+#ifdef LOAD_PROFILE
+        uint32_t ms = duration_cast<milliseconds>(tsEnd - tsStart).count();
+        profile[0].accumulate(ms, sample.p1.vrms);
+        profile[1].accumulate(ms, sample.p2.vrms);
+        profile[2].accumulate(ms, sample.p3.vrms);
+        profile[3].accumulate(ms, sample.p1.powerActive);
+        profile[4].accumulate(ms, sample.p2.powerActive);
+        profile[5].accumulate(ms, sample.p3.powerActive);
+#endif
+        derived.accumulate(sample, tsEnd);
+        double covaried[COVARIANCE_CHANNELS] = { sample.p1.vrms, sample.p2.vrms, sample.p3.vrms,
+                                                 sample.p1.powerActive, sample.p2.powerActive, sample.p3.powerActive };
+        covariance.accumulate(covaried);
+        demand.accumulate(system_clock::to_time_t(tsEnd), sample);
+#ifdef TIME_OF_USE
+        if (calendar != nullptr && calendar->count > 0)
+            tou[calendar->period(tsEnd)].accumulate(sample, weight);
+#endif
+#ifdef EXTREME_SAMPLES
+        Extreme extreme;
+        extreme.ts = tsEnd;
+        for (uint32_t c = 0; c < CHANNELS; c++)
+            extreme.value[c] = sample.channel(c);
+        for (uint32_t c = 0; c < CHANNELS; c++)
+            extremes[c].accumulate(c, extreme);
 #endif
         tsLast = tsEnd;
+        sampled = true;
 
         return true;
     }
 
-    assert(false);
     return false;
 }
 
+// Histogram bin boundaries and decimal places of each measured channel, in the order of Sample::channel().
+static const double* const measuredBinBoundary[CHANNELS] = { binBoundaryV, binBoundaryI, binBoundaryP, binBoundaryQ, binBoundaryPF,
+                                                             binBoundaryV, binBoundaryI, binBoundaryP, binBoundaryQ, binBoundaryPF,
+                                                             binBoundaryV, binBoundaryI, binBoundaryP, binBoundaryQ, binBoundaryPF,
+                                                             binBoundaryF };
+static constexpr int measuredDecimalPlaces[CHANNELS] = { 1, 2, 1, 1, 2, 1, 2, 1, 1, 2, 1, 2, 1, 1, 2, 1 };
+
+// Accumulate the given value of channel c, with the given weight, into its total, min and max, and histogram.
+// Returns false if it is NaN or beyond the last bin boundary, in which case it is not accumulated.
+bool Report::ChannelAccumulator::accumulate(uint32_t c, double val, uint32_t weight_)
+{
+    // Count the boundaries at or below the value, rather than searching for the first above it, to avoid unpredictable branches.
+    const double* boundary = measuredBinBoundary[c];
+    uint32_t b = 0;
+    for (uint32_t i = 0; i < HISTOGRAM_BINS; i++)
+        b += val >= boundary[i];
+    if (b >= HISTOGRAM_BINS || std::isnan(val))
+        return false;
+
+    bin[c][b] += weight_;
+    total[c].add(val * weight_);
+    weight[c] += weight_;
+    min[c] = fmin(min[c], val);                                 // NOTE fmin() and fmax() ignore the initial NaN
+    max[c] = fmax(max[c], val);
+    return true;
+}
+
+// Summarise channel c into the provided summary.  A channel with no values has a NaN average.
+void Report::ChannelAccumulator::summarise(uint32_t c, Summary& summary) const
+{
+    memcpy(summary.histogram.bin, bin[c], sizeof bin[c]);
+    summary.avg = round(weight[c] > 0.0 ? total[c].value() / weight[c] : NAN, measuredDecimalPlaces[c]);
+    summary.min = round(min[c], measuredDecimalPlaces[c]);
+    summary.max = round(max[c], measuredDecimalPlaces[c]);
+}
+
+void Report::ChannelAccumulator::reset()
+{
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        total[c].reset();
+        weight[c] = 0.0;
+        min[c] = max[c] = NAN;
+    }
+    memset(bin, 0, sizeof bin);
+}
+
 // Summarise all accumulated samples into the provided sample summary.
 // NOTE If any of the summaries fail, this will leave incorrect data in sampleSummary, but return false.
 bool Report::SampleAccumulator::summarise(SampleSummary& sampleSummary) const
 {
-    bool successP1 = p1.summarise(sampleSummary.p1, count);
-    bool successP2 = p2.summarise(sampleSummary.p2, count);
-    bool successP3 = p3.summarise(sampleSummary.p3, count);
-    bool successF = frequency.summarise(sampleSummary.frequency, count);
+    for (uint32_t c = 0; c < CHANNELS; c++)
+        channels.summarise(c, sampleSummary.channel(c));
+    bool successD = derived.summarise(sampleSummary.derived);
+    summations.summarise(sampleSummary.summations);
+    demand.summarise(sampleSummary.demand);
+    sampleSummary.covariance = covariance;
     sampleSummary.count = count;
     sampleSummary.tsStart = tsStart;
     sampleSummary.tsEnd = tsEnd;
     sampleSummary.intervalMin = intervalMin;
     sampleSummary.intervalMax = intervalMax;
+    sampleSummary.expectedPeriod = expectedPeriod;
+    sampleSummary.gaps = gaps;
+    sampleSummary.gapDuration = gapDuration;
+    memcpy(sampleSummary.rejected, rejected, sizeof rejected);
 #ifdef INTERVAL_ARRAY
     strncpy(sampleSummary.interval.array, interval.array, interval.index);
     sampleSummary.interval.index = interval.index;
 #endif
+#ifdef LOAD_PROFILE
+    for (uint32_t c = 0; c < PROFILE_CHANNELS; c++)
+        profile[c].summarise(sampleSummary.profile.channel[c]);
+#endif
+#ifdef EXTREME_SAMPLES
+    for (uint32_t c = 0; c < CHANNELS; c++)
+        sampleSummary.extremes[c] = extremes[c];
+#endif
+#ifdef FINE_HISTOGRAMS
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        FineSummary& summary = sampleSummary.fine[c];
+        for (uint32_t i = 0; i < FINE_PERCENTILES; i++)
+            summary.percentile[i] = fine[c].percentile(finePercentiles[i]);
+        summary.bins = rebinCount[c];
+        fine[c].rebin(rebinBoundary[c], rebinCount[c], summary.bin);
+    }
+#endif
+#ifdef TIME_OF_USE
+    sampleSummary.touCount = calendar != nullptr ? calendar->count : 0;
+    for (uint32_t p = 0; p < sampleSummary.touCount; p++)
+    {
+        tou[p].summarise(sampleSummary.tou[p]);
+        strcpy(sampleSummary.tou[p].name, calendar->name[p]);
+    }
+#endif
 
-    if (successP1 && successP2 && successP3 && successF)
+    if (count > 0 && successD)
         return true;
 
     assert(false);
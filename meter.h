@@ -14,6 +14,12 @@
 //    }
 //    report.summarise(sampleSummary);
 //    report.reset();
+//
+// Summaries from several sources (e.g. peer devices) may be combined, using count-weighted averages:
+//
+//    SampleSummary aggregate, peerSummary;
+//    if (peerSummary.set(peerJson))
+//        aggregate.merge(peerSummary);
 
 #pragma once
 
@@ -34,10 +40,28 @@ using namespace nlohmann;
 #define EXPECTED_FREQUENCY   50                                 // Options: 50, 60
 
 //#define INTERVAL_ARRAY                                          // Maintain and transmit a base-64 encoded array of intervals
+//#define LOAD_PROFILE                                            // Maintain and transmit swinging door compressed V and P profiles
+//#define EXTREME_SAMPLES                                         // Maintain and transmit the samples with each channel's extremes
+//#define TIME_OF_USE                                             // Maintain and transmit statistics per time-of-use period
+//#define FINE_HISTOGRAMS                                         // Maintain fine histograms, for percentiles and rebinning
+//#define DURATION_WEIGHTED                                       // Weight averages and histograms by the duration of each sample
 
 namespace Meter
 {
     static constexpr uint32_t HISTOGRAM_BINS = 12;
+    static constexpr uint32_t CHANNELS = 16;                    // Measured channels: V, I, P, Q, PF of each phase, and frequency
+    static constexpr uint32_t CHANNELS_VALID = (1u << CHANNELS) - 1;    // Validity bitmask of a sample with every channel valid
+    static constexpr uint32_t METER_ID_LENGTH = 31;             // Maximum length of a meter ID, excluding the terminator
+    static constexpr uint32_t MAX_REGISTERS = 8;                // Maximum number of summation registers tracked
+    static constexpr uint32_t REGISTER_NAME_LENGTH = 23;        // Maximum length of a register name, excluding the terminator
+    static constexpr double REGISTER_ROLLOVER_MARGIN = 0.1;     // Fraction of the modulus at each end between which a fall wraps
+    static constexpr uint32_t DEMAND_CHANNELS = 4;              // Active power of phases 1, 2 and 3, and in total
+    static constexpr uint32_t DEMAND_WINDOW_DEFAULT = 15;       // Default demand window, in minutes
+    static constexpr uint32_t DEMAND_WINDOW_MAX = 60;           // Maximum demand window, in minutes
+    static constexpr uint32_t DERIVED_CHANNELS = 9;             // Derived channels; see DerivedSummary
+    static constexpr uint32_t COVARIANCE_CHANNELS = 6;          // Channels covaried: Vrms of phases 1, 2 and 3, then active power
+    static constexpr double GAP_FACTOR = 1.5;                   // Intervals beyond this multiple of the expected period are gaps
+    static constexpr double ROCOF_INTERVAL_MAX = 5.0;           // Longest interval between samples to derive ROCOF over, in seconds
 
     // Boundaries of the histogram bins for Vrms, Irms, active power, reactive power, power factor, and frequency.
     // Each value is the upper bound for its corresponding bin, e.g. voltages [215.0..220.0) will count toward bin[3].
@@ -65,6 +89,22 @@ namespace Meter
                                                                   60.05,   60.10,   60.15,   60.20,   60.25,     HUGE_VAL };
 #endif
 
+    // Boundaries of the histogram bins for the derived channels: apparent power of a phase, total active, reactive and apparent
+    // power, voltage unbalance (as a percentage), and rate of change of frequency (in Hz/s).  Estimated neutral current uses the
+    // bins for Irms.
+    static constexpr double binBoundaryS[HISTOGRAM_BINS]  = {     10.0,    30.0,   100.0,   300.0,  1000.0,  2000.0,
+                                                                3000.0,  5000.0, 10000.0, 20000.0, 50000.0,      HUGE_VAL };
+    static constexpr double binBoundaryPT[HISTOGRAM_BINS] = { -30000.0,-10000.0, -3000.0, -1000.0,  -300.0,     0.0,
+                                                                 300.0,  1000.0,  3000.0, 10000.0, 30000.0,      HUGE_VAL };
+    static constexpr double binBoundaryQT[HISTOGRAM_BINS] = { -30000.0,-10000.0, -3000.0, -1000.0,  -300.0,     0.0,
+                                                                 300.0,  1000.0,  3000.0, 10000.0, 30000.0,      HUGE_VAL };
+    static constexpr double binBoundaryST[HISTOGRAM_BINS] = {     30.0,   100.0,   300.0,  1000.0,  3000.0,  6000.0,
+                                                               10000.0, 15000.0, 30000.0, 60000.0,150000.0,      HUGE_VAL };
+    static constexpr double binBoundaryVU[HISTOGRAM_BINS] = {      0.25,    0.5,     0.75,    1.0,     1.5,     2.0,
+                                                                   2.5,     3.0,     4.0,     5.0,    10.0,      HUGE_VAL };
+    static constexpr double binBoundaryROCOF[HISTOGRAM_BINS] = { -1.0,   -0.5,    -0.25,   -0.1,    -0.05,    0.0,
+                                                                   0.05,    0.1,     0.25,    0.5,     1.0,      HUGE_VAL };
+
     // Point-in-time voltage/current/power of a single phase.
     struct Phase
     {
@@ -82,18 +122,58 @@ namespace Meter
     };
 
     // Point-in-time voltage/current/power of up to three phases, plus frequency derived from Phase 1.
+    // Channels missing from the meter read, or not finite, are NaN, and their bits clear in the validity bitmask.
     struct Sample
     {
-        Sample() { frequency = 0.0; }
-        Sample(const xsd::mtrsvc::PowerQualityData& powerQualityData) { set(powerQualityData); }
-        static bool isValid(const xsd::mtrsvc::PowerQualityData& powerQualityData);
+        Sample() { frequency = 0.0; valid = CHANNELS_VALID; ts = system_clock::from_time_t(0); }
+        Sample(const xsd::mtrsvc::PowerQualityData& powerQualityData) { ts = system_clock::from_time_t(0); set(powerQualityData); }
         void set(const xsd::mtrsvc::PowerQualityData& powerQualityData);
-        void reset() { p1.reset(); p2.reset(); p3.reset(); frequency = 0.0; }
+        double channel(uint32_t i) const;
+        bool isValid(uint32_t i) const { return (valid & 1u << i) != 0; }
+        void reset() { p1.reset(); p2.reset(); p3.reset(); frequency = 0.0; valid = CHANNELS_VALID;
+                       ts = system_clock::from_time_t(0); }
 
         Phase p1;
         Phase p2;
         Phase p3;
         double frequency;
+        uint32_t valid;                                         // Bit i set if channel i, in the order of channel(), is valid
+        time_point<system_clock> ts;                            // Time read, or the epoch if unknown, to be taken as when accumulated
+    };
+
+    // A summation register field of the SummationData, by its path, e.g. "del.wh" for {"del":{"wh":1}}, and the register's
+    // declared modulus, i.e. the value its readings wrap to 0 on reaching, or 0 if it does not wrap.
+    struct RegisterField
+    {
+        const char* path;
+        double modulus;
+    };
+
+    // Point-in-time readings of up to MAX_REGISTERS named summation (e.g. energy) registers.
+    struct Summations
+    {
+        Summations() { count = 0; }
+        void set(const nlohmann::json& j, const RegisterField* fields, uint32_t fieldCount);
+        void reset() { count = 0; }
+
+        char name[MAX_REGISTERS][REGISTER_NAME_LENGTH + 1];
+        double value[MAX_REGISTERS];
+        double modulus[MAX_REGISTERS];
+        uint32_t count;
+    };
+
+    // Running sum with Neumaier's compensation, so that its rounding error stays at a few ulps however many values are summed,
+    // rather than growing with their number (e.g. a month of per-second power readings).  The branch reduces to a select, so
+    // the cost is a handful of additions per value.
+    struct CompensatedSum
+    {
+        CompensatedSum() { reset(); }
+        void add(double x) { double t = sum + x; compensation += fabs(sum) >= fabs(x) ? (sum - t) + x : (x - t) + sum; sum = t; }
+        double value() const { return sum + compensation; }
+        void reset() { sum = compensation = 0.0; }
+
+        double sum;
+        double compensation;                                    // Low order bits lost from sum
     };
 
     // Histogram with a fixed number of bins, representing the number of times values have fallen into certain ranges.
@@ -101,6 +181,8 @@ namespace Meter
     {
         Histogram() { reset(); }
         void json(ordered_json& j) const;
+        bool set(const nlohmann::json& j);
+        void merge(const Histogram& other);
         void reset() { memset(&bin, 0, HISTOGRAM_BINS * sizeof (uint32_t)); }
 
         uint32_t bin[HISTOGRAM_BINS];
@@ -110,7 +192,9 @@ namespace Meter
     struct Summary
     {
         Summary() { avg = 0.0; min = max = NAN; }
-        void json(ordered_json& j) const;
+        void json(ordered_json& j, bool withHistogram = true) const;
+        bool set(const nlohmann::json& j);
+        void merge(const Summary& other, uint32_t count, uint32_t otherCount);
         void reset() { histogram.reset(); avg = 0.0; min = max = NAN; }
 
         Histogram histogram;
@@ -122,7 +206,9 @@ namespace Meter
     // Summary voltage/current/power of a single phase.
     struct PhaseSummary
     {
-        void json(ordered_json& j) const;
+        void json(ordered_json& j, bool withHistograms = true) const;
+        bool set(const nlohmann::json& j);
+        void merge(const PhaseSummary& other, uint32_t count, uint32_t otherCount);
         void reset() { vrms.reset(); irms.reset(); powerActive.reset(); powerReactive.reset(); powerFactor.reset(); }
 
         Summary vrms;
@@ -132,6 +218,130 @@ namespace Meter
         Summary powerFactor;
     };
 
+    // Summary of the quantities derived from each sample: the apparent power of each phase; the total active, reactive and
+    // apparent power; the voltage unbalance, as the greatest deviation of a phase from the average Vrms, as a percentage of the
+    // average; the neutral current, estimated as the phasor sum of the phase currents, assuming phase voltages 120 degrees apart
+    // and each current lagging its voltage by its power factor angle; and the rate of change of frequency.  A quantity that
+    // cannot be derived from a sample is skipped, so each has its own count.
+    struct DerivedSummary
+    {
+        DerivedSummary() { reset(); }
+        void json(ordered_json& j, bool withHistograms = true) const;
+        bool set(const nlohmann::json& j, uint32_t samples);
+        void merge(const DerivedSummary& other);
+        Summary& channel(uint32_t i);
+        const Summary& channel(uint32_t i) const { return const_cast<DerivedSummary*>(this)->channel(i); }
+        void reset() { for (uint32_t c = 0; c < DERIVED_CHANNELS; c++) { channel(c).reset(); count[c] = 0; } }
+
+        Summary powerApparent1;
+        Summary powerApparent2;
+        Summary powerApparent3;
+        Summary powerActiveTotal;
+        Summary powerReactiveTotal;
+        Summary powerApparentTotal;
+        Summary voltageUnbalance;
+        Summary neutralCurrent;
+        Summary rocof;
+        uint32_t count[DERIVED_CHANNELS];                       // Number of values summarised by each channel
+    };
+
+    // Summary of a single summation register: its first and last values, the total increase, and the number of rollovers (the
+    // register wrapping past its modulus) and resets (any other decrease).
+    struct RegisterSummary
+    {
+        RegisterSummary() { reset(); }
+        void json(ordered_json& j) const;
+        bool set(const nlohmann::json& j);
+        void merge(const RegisterSummary& other);
+        void reset() { name[0] = '\0'; first = last = NAN; delta = 0.0; rollovers = resets = 0; }
+
+        char name[REGISTER_NAME_LENGTH + 1];
+        double first;
+        double last;
+        double delta;
+        uint32_t rollovers;
+        uint32_t resets;
+    };
+
+    // Summary of all summation registers read.
+    struct SummationSummary
+    {
+        SummationSummary() { count = 0; }
+        void json(ordered_json& j) const;
+        bool set(const nlohmann::json& j);
+        void merge(const SummationSummary& other);
+        void reset() { for (uint32_t i = 0; i < count; i++) registers[i].reset(); count = 0; }
+
+        RegisterSummary registers[MAX_REGISTERS];
+        uint32_t count;
+    };
+
+    // Peak demand, i.e. the maximum rolling average active power over a window of whole minutes, of each phase and in total, and
+    // the time each peak window ended.
+    struct DemandSummary
+    {
+        DemandSummary() { reset(); }
+        void json(ordered_json& j) const;
+        bool set(const nlohmann::json& j);
+        void merge(const DemandSummary& other);
+        void reset() { window = 0; for (uint32_t c = 0; c < DEMAND_CHANNELS; c++) { peak[c] = NAN; time[c] = 0; } }
+
+        uint32_t window;                                        // Window length, in minutes, or 0 if demand is not measured
+        double peak[DEMAND_CHANNELS];                           // NaN if no window has been complete
+        uint32_t time[DEMAND_CHANNELS];                         // Seconds since the epoch
+    };
+
+    // Means and covariance matrix of the Vrms and active power of each phase, updated incrementally with each sample (Welford),
+    // and merged pairwise (Chan et al), so that summaries of any number of samples combine exactly.  Each term of the matrix is
+    // over the samples in which both of its channels are valid, with the means of the two channels over those samples, so that
+    // a missing or invalid channel costs only the terms it is in.  From these follow the sensitivity of each phase's voltage to
+    // its load, dV/dP, and the correlation between every pair of channels.
+    struct Covariance
+    {
+        static constexpr uint32_t TERMS = COVARIANCE_CHANNELS * (COVARIANCE_CHANNELS + 1) / 2;
+
+        Covariance() { reset(); }
+        void accumulate(const double* x);
+        void json(ordered_json& j) const;
+        bool set(const nlohmann::json& j);
+        void merge(const Covariance& other);
+        double covariance(uint32_t a, uint32_t b) const;
+        bool empty() const;
+        void reset() { for (uint32_t t = 0; t < TERMS; t++) { count[t] = 0; meanA[t] = meanB[t] = comoment[t] = 0.0; } }
+
+        uint32_t count[TERMS];                                  // Samples with both channels valid, upper triangle by rows
+        double meanA[TERMS];                                    // Means over them of the term's first and second channels
+        double meanB[TERMS];
+        double comoment[TERMS];                                 // Sums over them of products of deviations from the means
+
+    private:
+        static uint32_t index(uint32_t a, uint32_t b);
+    };
+
+    // Weekly EN 50160 compliance of the supply voltage, frequency and voltage unbalance, from clock-aligned 10 minute aggregates
+    // of the Vrms of each phase and of the unbalance, and 10 second aggregates of the frequency; see Compliance.
+    struct ComplianceSummary
+    {
+        ComplianceSummary() { reset(); }
+        void json(ordered_json& j) const;
+        void reset();
+
+        uint32_t weekStart;                                     // Seconds since the epoch, or 0 if no week has begun
+        uint32_t voltageCount[3];                               // Number of 10 minute Vrms aggregates of each phase
+        double voltageInRange[3];                               // Percentage within +/-10% of nominal
+        bool voltageInLimits[3];                                // All within +10%/-15% of nominal
+        double voltageP5[3];                                    // 5th and 95th percentiles, in volts
+        double voltageP95[3];
+        uint32_t frequencyCount;                                // Number of 10 second frequency aggregates
+        double frequencyInRange;                                // Percentage within +/-1% of nominal
+        bool frequencyInLimits;                                 // All within +4%/-6% of nominal
+        double frequencyP0_5;                                   // 0.5th and 99.5th percentiles, in Hz
+        double frequencyP99_5;
+        uint32_t unbalanceCount;                                // Number of 10 minute voltage unbalance aggregates
+        double unbalanceP95;                                    // 95th percentile, as a percentage
+        bool pass;                                              // All of the above within the standard's limits
+    };
+
 #ifdef INTERVAL_ARRAY
     // Fixed size, character-based array, used here to store base64-encoded time intervals in the range 0 through 10 seconds.
     struct CharArray
@@ -147,16 +357,182 @@ namespace Meter
     };
 #endif
 
+#ifdef LOAD_PROFILE
+    static constexpr uint32_t PROFILE_CHANNELS = 6;             // Vrms and active power of each phase
+    static constexpr uint32_t PROFILE_VERTICES = 360;           // Maximum number of vertices per channel per report
+    static constexpr double PROFILE_TOLERANCE_V = 0.5;          // Default maximum deviation of the Vrms profiles from the samples
+    static constexpr double PROFILE_TOLERANCE_P = 20.0;         // Default maximum deviation of the active power profiles
+
+    // Piecewise linear approximation of a channel, as a fixed size array of vertices.
+    struct Profile
+    {
+        Profile() { reset(); }
+        bool append(uint32_t ms, float value);
+        void json(ordered_json& j) const;
+        void reset() { count = 0; truncated = false; }
+
+        uint32_t time[PROFILE_VERTICES];                        // Milliseconds since the start of the report period
+        float value[PROFILE_VERTICES];
+        uint32_t count;
+        bool truncated;                                         // Vertices were dropped for lack of space
+    };
+
+    // Profiles of the Vrms of phases 1, 2 and 3, followed by the active power of phases 1, 2 and 3.
+    struct ProfileSummary
+    {
+        void json(ordered_json& j) const;
+        void reset() { for (Profile& profile : channel) profile.reset(); }
+
+        Profile channel[PROFILE_CHANNELS];
+    };
+#endif
+
+#ifdef EXTREME_SAMPLES
+    static constexpr uint32_t EXTREME_COUNT = 3;                // Number of highest and of lowest values kept per channel
+
+    // A sample holding an extreme value of some channel: the time it was taken, and the values of every channel.
+    struct Extreme
+    {
+        time_point<system_clock> ts;
+        float value[CHANNELS];
+    };
+
+    // The EXTREME_COUNT highest and lowest values of a channel, each list most extreme first, with their samples.  Ties are
+    // resolved in favour of the earliest sample.
+    struct Extremes
+    {
+        Extremes() { reset(); }
+        void accumulate(uint32_t channel, const Extreme& extreme);
+        void json(ordered_json& j, uint32_t channel) const;
+        void merge(const Extremes& other, uint32_t channel);
+        void reset() { highCount = lowCount = 0; }
+
+        Extreme high[EXTREME_COUNT];
+        Extreme low[EXTREME_COUNT];
+        uint32_t highCount;
+        uint32_t lowCount;
+    };
+#endif
+
+#ifdef FINE_HISTOGRAMS
+    static constexpr uint32_t FINE_BINS = 768;                  // Bins per fine histogram
+    static constexpr uint32_t FINE_OCTAVE_BINS = 16;            // Log-linear bins per doubling of magnitude
+    static constexpr uint32_t FINE_REBIN_MAX = 32;              // Maximum number of bins to rebin a fine histogram into
+    static constexpr uint32_t FINE_PERCENTILES = 5;
+    static constexpr double finePercentiles[FINE_PERCENTILES] = { 1.0, 5.0, 50.0, 95.0, 99.0 };
+
+    // Fine histogram of a channel, with FINE_BINS bins either of equal width from low upwards, or, for channels spanning orders
+    // of magnitude, HDR-style signed log-linear bins: a bin of magnitudes below low, flanked by FINE_OCTAVE_BINS equal bins per
+    // doubling of magnitude either side, for a resolution within 1/FINE_OCTAVE_BINS of the value.  Values beyond the bins are
+    // counted below or above them.  With DURATION_WEIGHTED, each bin holds the total weight of its values rather than a count.
+    struct FineHistogram
+    {
+        FineHistogram() { logLinear = false; low = 0.0; width = 1.0; reset(); }
+        void setChannel(uint32_t channel);
+        void accumulate(double val, uint32_t weight);
+        void rebin(const double* boundaries, uint32_t n, uint32_t* counts) const;
+        double percentile(double p) const;
+        void bounds(uint32_t i, double& lower, double& upper) const;
+        void reset() { total = below = above = 0; memset(bin, 0, sizeof bin); }
+
+        bool logLinear;
+        double low;                                             // Lower bound of the bins, or of the magnitudes if log-linear
+        double width;                                           // Width of each bin, if linear
+        uint32_t total;
+        uint32_t below;
+        uint32_t above;
+        uint32_t bin[FINE_BINS];
+    };
+
+    // Percentiles of a channel from its fine histogram, and its fine histogram rebinned into the given boundaries, if any.
+    struct FineSummary
+    {
+        FineSummary() { reset(); }
+        void json(ordered_json& j) const;
+        void merge(const FineSummary& other);
+        void reset() { for (double& p : percentile) p = NAN; bins = 0; }
+
+        double percentile[FINE_PERCENTILES];                    // In the order of finePercentiles
+        uint32_t bins;                                          // Number of rebinned bins, or 0 if none
+        uint32_t bin[FINE_REBIN_MAX];
+    };
+#endif
+
+#ifdef TIME_OF_USE
+    static constexpr uint32_t TOU_PERIODS = 4;                  // Maximum number of time-of-use periods
+    static constexpr uint32_t TOU_NAME_LENGTH = 15;             // Maximum length of a period name, excluding the terminator
+    static constexpr uint32_t MINUTES_PER_WEEK = 7 * 24 * 60;
+
+    // Time-of-use calendar: a set of named periods (e.g. off-peak, shoulder and peak), and a lookup table of the period each
+    // minute of the local week falls in, compiled from a configuration object; see set().
+    struct TouCalendar
+    {
+        TouCalendar() { reset(); }
+        bool set(const nlohmann::json& j);
+        uint32_t period(time_point<system_clock> ts) const;
+        void reset() { count = 0; memset(table, 0, sizeof table); }
+
+        char name[TOU_PERIODS][TOU_NAME_LENGTH + 1];
+        uint32_t count;                                         // Number of periods, or 0 if no calendar is configured
+        uint8_t table[MINUTES_PER_WEEK];                        // Period of each minute of the week, from Sunday 00:00 local time
+    };
+
+    // Summary voltage/current/power of up to three phases plus frequency, over the samples within a time-of-use period.
+    struct TouSummary
+    {
+        TouSummary() { reset(); }
+        void json(ordered_json& j) const;
+        bool set(const nlohmann::json& j);
+        void merge(const TouSummary& other);
+        const Summary& channel(uint32_t i) const;
+        Summary& channel(uint32_t i) { return const_cast<Summary&>(static_cast<const TouSummary*>(this)->channel(i)); }
+        void reset() { name[0] = '\0'; p1.reset(); p2.reset(); p3.reset(); frequency.reset(); count = 0;
+                       memset(rejected, 0, sizeof rejected); }
+
+        char name[TOU_NAME_LENGTH + 1];
+        PhaseSummary p1;
+        PhaseSummary p2;
+        PhaseSummary p3;
+        Summary frequency;
+        uint32_t count;
+        uint32_t rejected[CHANNELS];                            // Number of missing or invalid values of each channel
+    };
+#endif
+
     // Summary voltage/current/power of up to three phases plus frequency, as well as the count of samples covered.
     struct SampleSummary
     {
-        SampleSummary() { count = 0; intervalMin = milliseconds(INT32_MAX); intervalMax = milliseconds(0); }
+        SampleSummary() { count = 0; sources = 0; intervalMin = milliseconds(INT32_MAX); intervalMax = milliseconds(0);
+                          expectedPeriod = gapDuration = milliseconds(0); gaps = duplicates = late = resyncs = 0;
+                          memset(rejected, 0, sizeof rejected); meterId[0] = '\0'; score = NAN; heartbeat = brief = false;
+                          sequence = 0; }
         void json(ordered_json& j) const;
-        void reset() { p1.reset(); p2.reset(); p3.reset(); frequency.reset(); count = 0;
+        bool set(const nlohmann::json& j);
+        void merge(const SampleSummary& other);
+        const Summary& channel(uint32_t i) const;
+        Summary& channel(uint32_t i) { return const_cast<Summary&>(static_cast<const SampleSummary*>(this)->channel(i)); }
+        void reset() { p1.reset(); p2.reset(); p3.reset(); frequency.reset(); derived.reset(); summations.reset(); demand.reset();
+                       covariance.reset(); compliance.reset(); complianceLast.reset(); count = 0; sources = 0;
+                       meterId[0] = '\0'; score = NAN; heartbeat = brief = false; sequence = 0;
                        tsStart = tsEnd = system_clock::from_time_t(0);
                        intervalMin = milliseconds(INT32_MAX); intervalMax = milliseconds(0);
+                       expectedPeriod = gapDuration = milliseconds(0); gaps = duplicates = late = resyncs = 0;
+                       memset(rejected, 0, sizeof rejected);
 #ifdef INTERVAL_ARRAY
                        interval.reset();
+#endif
+#ifdef LOAD_PROFILE
+                       profile.reset();
+#endif
+#ifdef EXTREME_SAMPLES
+                       for (Extremes& e : extremes) e.reset();
+#endif
+#ifdef TIME_OF_USE
+                       for (TouSummary& t : tou) t.reset();
+                       touCount = 0;
+#endif
+#ifdef FINE_HISTOGRAMS
+                       for (FineSummary& s : fine) s.reset();
 #endif
                      }
 
@@ -164,39 +540,90 @@ namespace Meter
         PhaseSummary p2;
         PhaseSummary p3;
         Summary frequency;
+        DerivedSummary derived;
+        SummationSummary summations;
+        DemandSummary demand;
+        Covariance covariance;
+        ComplianceSummary compliance;                           // Compliance over the week so far, if measured
+        ComplianceSummary complianceLast;                       // Compliance over the last complete week, if any
         uint32_t count;
+        uint32_t sources;                                       // Number of summaries merged into this one, or 0 if none
         time_point<system_clock> tsStart;
         time_point<system_clock> tsEnd;
         milliseconds intervalMin;
         milliseconds intervalMax;
+        milliseconds expectedPeriod;                            // Expected interval between samples, or 0 if unknown
+        uint32_t gaps;                                          // Number of intervals longer than GAP_FACTOR expected periods
+        milliseconds gapDuration;                               // Total duration of those intervals beyond the expected period
+        uint32_t duplicates;                                    // Number of duplicate samples dropped before accumulation
+        uint32_t late;                                          // Number of samples dropped as too late to accumulate in order
+        uint32_t resyncs;                                       // Number of times the read order restarted, the clock stepping back
+        uint32_t rejected[CHANNELS];                            // Number of missing or invalid values of each channel
+        char meterId[METER_ID_LENGTH + 1];                      // Metering point, or empty for the device's own meter
+        double score;                                           // Anomaly score against the baseline, or NaN if not scored
+        bool heartbeat;                                         // Encode only the count, times, score and summations
+        bool brief;                                             // Encode without histograms or bulky optional detail
+        uint32_t sequence;                                      // Sequence number assigned when sent, or 0 if none
 #ifdef INTERVAL_ARRAY
         CharArray interval;
+#endif
+#ifdef LOAD_PROFILE
+        ProfileSummary profile;
+#endif
+#ifdef EXTREME_SAMPLES
+        Extremes extremes[CHANNELS];                            // Extremes of each channel, in the order of channel()
+#endif
+#ifdef TIME_OF_USE
+        TouSummary tou[TOU_PERIODS];
+        uint32_t touCount;                                      // Number of time-of-use periods summarised
+#endif
+#ifdef FINE_HISTOGRAMS
+        FineSummary fine[CHANNELS];                             // Fine histogram summary of each channel, in the order of channel()
 #endif
     };
 
     class Report
     {
     public:
-        Report() { reset(); }
+        Report() {
+#ifdef LOAD_PROFILE
+                   setProfileTolerance(PROFILE_TOLERANCE_V, PROFILE_TOLERANCE_P);
+#endif
+                   reset(); }
         ~Report() = default;
         bool accumulate(const Sample& sample);
+        bool accumulate(const Summations& summations);
         bool summarise(SampleSummary& sampleSummary);
         uint32_t count();
         void reset();
+#ifdef LOAD_PROFILE
+        void setProfileTolerance(double vrms, double powerActive);
+#endif
+        void setDemandWindow(uint32_t minutes);
+        void setExpectedPeriod(milliseconds period);
+#ifdef TIME_OF_USE
+        void setCalendar(const TouCalendar* calendar);
+#endif
+#ifdef FINE_HISTOGRAMS
+        bool setRebinning(uint32_t channel, const double* boundaries, uint32_t n);
+#endif
 
     private:
-        // Accumulated doubles, with their total, minimum and maximum values, and a histogram.
+        // Accumulated doubles, with their weighted total, total weight, minimum and maximum values, and a weighted histogram.
+        // Each value is weighted by 1 unless given a weight, e.g. its duration in milliseconds, in which case the histogram holds
+        // the total weight of the values within each bin.
         // Derived classes override binBoundaryPtr to establish different histogram bins; it is not intended to use this base class
         // directly.
         struct Accumulator
         {
-            Accumulator() { total = 0.0; min = max = NAN; }
-            bool accumulate(const double val);
+            Accumulator() { weight = 0.0; min = max = NAN; }
+            bool accumulate(const double val, uint32_t weight_ = 1);
             bool summarise(Summary& summary, uint32_t count) const;
-            void reset() { histogram.reset(); total = 0.0; min = max = NAN; }
+            void reset() { histogram.reset(); total.reset(); weight = 0.0; min = max = NAN; }
 
             Histogram histogram;
-            double total;
+            CompensatedSum total;
+            double weight;
             double min;
             double max;
 
@@ -241,10 +668,51 @@ namespace Meter
             AccumulatorFrequency() { binBoundaryPtr = binBoundaryF; decimalPlaces = 1; }
         };
 
+        // Accumulated apparent power values, of a phase.
+        struct AccumulatorPowerApparent : Accumulator
+        {
+            AccumulatorPowerApparent() { binBoundaryPtr = binBoundaryS; decimalPlaces = 1; }
+        };
+
+        // Accumulated total active power values.
+        struct AccumulatorPowerActiveTotal : Accumulator
+        {
+            AccumulatorPowerActiveTotal() { binBoundaryPtr = binBoundaryPT; decimalPlaces = 1; }
+        };
+
+        // Accumulated total reactive power values.
+        struct AccumulatorPowerReactiveTotal : Accumulator
+        {
+            AccumulatorPowerReactiveTotal() { binBoundaryPtr = binBoundaryQT; decimalPlaces = 1; }
+        };
+
+        // Accumulated total apparent power values.
+        struct AccumulatorPowerApparentTotal : Accumulator
+        {
+            AccumulatorPowerApparentTotal() { binBoundaryPtr = binBoundaryST; decimalPlaces = 1; }
+        };
+
+        // Accumulated voltage unbalance values.
+        struct AccumulatorVoltageUnbalance : Accumulator
+        {
+            AccumulatorVoltageUnbalance() { binBoundaryPtr = binBoundaryVU; decimalPlaces = 2; }
+        };
+
+        // Accumulated estimated neutral current values.
+        struct AccumulatorNeutralCurrent : Accumulator
+        {
+            AccumulatorNeutralCurrent() { binBoundaryPtr = binBoundaryI; decimalPlaces = 2; }
+        };
+
+        // Accumulated rate of change of frequency values.
+        struct AccumulatorRocof : Accumulator
+        {
+            AccumulatorRocof() { binBoundaryPtr = binBoundaryROCOF; decimalPlaces = 3; }
+        };
+
         // Accumulated voltage/current/power of a single phase.
         struct PhaseAccumulator
         {
-            bool accumulate(const Phase& phase);
             bool summarise(PhaseSummary& summary, uint32_t count) const;
             void reset() { vrms.reset(); irms.reset(); powerActive.reset(); powerReactive.reset(); powerFactor.reset(); }
 
@@ -255,35 +723,227 @@ namespace Meter
             AccumulatorPowerFactor powerFactor;
         };
 
+        // Accumulated quantities derived from each sample, as described for DerivedSummary.  A derived quantity that cannot be
+        // computed for a sample (e.g. the voltage unbalance of a single phase meter) is skipped, so each has its own count.
+        // The last frequency and its time are retained across resets, so that ROCOF is continuous from one report to the next.
+        struct DerivedAccumulator
+        {
+            DerivedAccumulator() { frequencyLast = NAN; reset(); }
+            void accumulate(const Sample& sample, time_point<system_clock> ts);
+            bool summarise(DerivedSummary& summary) const;
+            Accumulator& channel(uint32_t i);
+            const Accumulator& channel(uint32_t i) const { return const_cast<DerivedAccumulator*>(this)->channel(i); }
+            void reset() { for (uint32_t c = 0; c < DERIVED_CHANNELS; c++) { channel(c).reset(); count[c] = 0; } }
+
+            AccumulatorPowerApparent powerApparent1;
+            AccumulatorPowerApparent powerApparent2;
+            AccumulatorPowerApparent powerApparent3;
+            AccumulatorPowerActiveTotal powerActiveTotal;
+            AccumulatorPowerReactiveTotal powerReactiveTotal;
+            AccumulatorPowerApparentTotal powerApparentTotal;
+            AccumulatorVoltageUnbalance voltageUnbalance;
+            AccumulatorNeutralCurrent neutralCurrent;
+            AccumulatorRocof rocof;
+            uint32_t count[DERIVED_CHANNELS];                   // Number of values accumulated into each channel
+            double frequencyLast;                               // Frequency and time of the last sample, for ROCOF
+            time_point<system_clock> tsLast;
+        };
+
+        // Accumulated readings of a single summation register.  Once read, the last reading is retained across resets as the first
+        // of the next report period, so that no increase is lost between report periods.
+        struct RegisterAccumulator
+        {
+            RegisterAccumulator() { name[0] = '\0'; first = last = NAN; delta = 0.0; rollovers = resets = 0; }
+            void accumulate(const double val, const double modulus);
+            void summarise(RegisterSummary& summary) const;
+            void reset() { first = last; delta = 0.0; rollovers = resets = 0; }
+
+            char name[REGISTER_NAME_LENGTH + 1];
+            double first;
+            double last;
+            double delta;
+            uint32_t rollovers;
+            uint32_t resets;
+        };
+
+        // Accumulated readings of all summation registers, matched by name.
+        struct SummationAccumulator
+        {
+            SummationAccumulator() { count = 0; }
+            bool accumulate(const Summations& summations);
+            void summarise(SummationSummary& summary) const;
+            void reset() { for (uint32_t i = 0; i < count; i++) registers[i].reset(); }
+
+            RegisterAccumulator registers[MAX_REGISTERS];
+            uint32_t count;                                     // Number of registers seen; NOTE Not reset
+        };
+
+        // Rolling average active power over a window of whole minutes, of each phase and in total, and its peak.  Samples are
+        // averaged over each minute; as each minute completes, the window slides on by a minute, and its average is compared with
+        // the peak.  Only windows of consecutive minutes, each with samples, count.  The window is retained across resets, so that
+        // demand is continuous from one report period to the next.  A phase's missing or invalid values are skipped, the total
+        // being over the phases valid in each sample, so a window counts for a phase only if each minute has valid values of it.
+        // NOTE The peak of a sliding window average only ever needs the running maximum, so no monotonic deque is needed.
+        struct DemandAccumulator
+        {
+            DemandAccumulator() { window = DEMAND_WINDOW_DEFAULT; restart(); }
+            void accumulate(uint32_t ts, const Sample& sample);
+            void summarise(DemandSummary& summary) const;
+            void reset() { for (uint32_t c = 0; c < DEMAND_CHANNELS; c++) { peak[c] = NAN; time[c] = 0; } }
+            void restart();
+
+            uint32_t window;                                    // Window length, in minutes
+            uint32_t minute;                                    // Minute being averaged, in minutes since the epoch
+            uint32_t count[DEMAND_CHANNELS];                    // Number of valid values in that minute, and their totals
+            double total[DEMAND_CHANNELS];
+            uint32_t minuteLast;                                // Last minute completed
+            uint32_t filled;                                    // Number of consecutive minutes completed, up to the window
+            double average[DEMAND_WINDOW_MAX][DEMAND_CHANNELS]; // Average of each minute completed, indexed by minute % window
+            double peak[DEMAND_CHANNELS];
+            uint32_t time[DEMAND_CHANNELS];                     // End of each peak window, in seconds since the epoch
+        };
+
+#ifdef TIME_OF_USE
+        // Accumulated voltage/current/power of up to three phases and frequency, of the samples within a time-of-use period.
+        // As for SampleAccumulator, each channel's valid values are accumulated and its missing or invalid values are counted as
+        // rejected.
+        struct TouAccumulator
+        {
+            TouAccumulator() { reset(); }
+            bool accumulate(const Sample& sample, uint32_t weight);
+            bool summarise(TouSummary& summary) const;
+            Accumulator& channel(uint32_t i);
+            void reset() { p1.reset(); p2.reset(); p3.reset(); frequency.reset(); count = 0; memset(rejected, 0, sizeof rejected); }
+
+            PhaseAccumulator p1;
+            PhaseAccumulator p2;
+            PhaseAccumulator p3;
+            AccumulatorFrequency frequency;
+            uint32_t count;
+            uint32_t rejected[CHANNELS];                        // Number of missing or invalid values of each channel
+        };
+#endif
+
+#ifdef LOAD_PROFILE
+        // Online swinging door compression of a channel into a Profile, such that every sample lies within the tolerance of the
+        // profile.  Each vertex is only emitted once a subsequent sample shows that no straight line from the previous vertex can
+        // stay within the tolerance of every sample since; the last sample seen is held back until then.
+        struct SwingingDoor
+        {
+            SwingingDoor() { tolerance = toleranceNext = 0.0; reset(); }
+            void accumulate(uint32_t ms, double val);
+            void summarise(Profile& summary) const;
+            void reset() { profile.reset(); started = false; tolerance = toleranceNext; }
+
+            Profile profile;                                    // Vertices emitted so far
+            double tolerance;
+            double toleranceNext;                               // Tolerance to apply from the next reset
+            bool started;                                       // The first vertex of the period has been emitted
+            uint32_t msVertex;                                  // Time and value of the last vertex emitted
+            double valVertex;
+            uint32_t msHeld;                                    // Time and value of the last sample, not yet emitted
+            double valHeld;
+            double slopeUpper;                                  // Door slopes, pivoting at the last vertex +/- tolerance
+            double slopeLower;
+        };
+#endif
+
+        // Accumulated values of every measured channel, in the order of Sample::channel(), with their compensated weighted total,
+        // total weight, minimum and maximum values, and histogram, as for Accumulator.  The state is channel-major, each statistic
+        // of all channels being a cache line aligned array, so that a sample touches a few adjacent lines rather than 16 scattered
+        // accumulators, and the per-channel bin boundaries and decimal places are shared tables rather than interleaved with it.
+        struct alignas(64) ChannelAccumulator
+        {
+            ChannelAccumulator() { reset(); }
+            bool accumulate(uint32_t c, double val, uint32_t weight_);
+            void summarise(uint32_t c, Summary& summary) const;
+            void reset();
+
+            alignas(64) CompensatedSum total[CHANNELS];
+            alignas(64) double weight[CHANNELS];
+            alignas(64) double min[CHANNELS];
+            alignas(64) double max[CHANNELS];
+            alignas(64) uint32_t bin[CHANNELS][HISTOGRAM_BINS];
+        };
+
         // Accumulated voltage/current/power of up to three phases, frequency, and the count and timestamps.
+        // Each channel's valid values are accumulated, and its missing or invalid values are counted as rejected, so that each
+        // channel's average is over its own valid values.  Given the expected period between samples, each interval longer than
+        // GAP_FACTOR expected periods is counted as a gap, and the time beyond the expected period as missing.  If
+        // DURATION_WEIGHTED, each sample's measured channels are weighted by the interval since the previous sample, up to the
+        // expected period if given, so that irregular or adaptive sampling does not bias the averages and histograms, and a gap
+        // is not credited to the sample that ends it.
         struct SampleAccumulator
         {
-            SampleAccumulator() { count = 0; tsLast = tsStart = tsEnd = system_clock::now();
-                                  intervalMin = milliseconds(INT32_MAX); intervalMax = milliseconds(0); }
+            SampleAccumulator() { count = 0; tsLast = tsStart = tsEnd = system_clock::now(); sampled = false;
+                                  memset(rejected, 0, sizeof rejected);
+#ifdef FINE_HISTOGRAMS
+                                  for (uint32_t c = 0; c < CHANNELS; c++) fine[c].setChannel(c);
+#endif
+                                  intervalMin = milliseconds(INT32_MAX); intervalMax = milliseconds(0);
+                                  expectedPeriod = gapDuration = milliseconds(0); gaps = 0; }
             bool accumulate(const Sample& sample);
             bool summarise(SampleSummary& sampleSummary) const;
-            void reset() { p1.reset(); p2.reset(); p3.reset(); frequency.reset(); count = 0; tsLast = tsStart = tsEnd;
+            void reset() { channels.reset(); derived.reset(); summations.reset();
+                           demand.reset(); covariance.reset(); count = 0; memset(rejected, 0, sizeof rejected);
+                           tsLast = tsStart = tsEnd;
                            intervalMin = milliseconds(INT32_MAX); intervalMax = milliseconds(0);
+                           gapDuration = milliseconds(0); gaps = 0;
 #ifdef INTERVAL_ARRAY
                            interval.reset();
+#endif
+#ifdef LOAD_PROFILE
+                           for (SwingingDoor& door : profile) door.reset();
+#endif
+#ifdef EXTREME_SAMPLES
+                           for (Extremes& e : extremes) e.reset();
+#endif
+#ifdef TIME_OF_USE
+                           for (TouAccumulator& t : tou) t.reset();
+#endif
+#ifdef FINE_HISTOGRAMS
+                           for (FineHistogram& h : fine) h.reset();
 #endif
                          }
 
-            PhaseAccumulator p1;
-            PhaseAccumulator p2;
-            PhaseAccumulator p3;
-            AccumulatorFrequency frequency;
-            uint32_t count;
+            ChannelAccumulator channels;                        // Hot state, updated by every sample; the rest is mostly cold
+            DerivedAccumulator derived;
+            SummationAccumulator summations;
+            DemandAccumulator demand;
+            Covariance covariance;
+            uint32_t count;                                     // Number of samples with at least one valid channel
+            uint32_t rejected[CHANNELS];                        // Number of missing or invalid values of each channel
             time_point<system_clock> tsLast;
             time_point<system_clock> tsStart;
             time_point<system_clock> tsEnd;
             milliseconds intervalMin;
             milliseconds intervalMax;
+            bool sampled;                                       // A sample has been accumulated since construction; NOTE Not reset
+            milliseconds expectedPeriod;                        // Expected interval between samples, or 0 if unknown; NOTE Not reset
+            uint32_t gaps;
+            milliseconds gapDuration;
 #ifdef INTERVAL_ARRAY
             CharArray interval;
+#endif
+#ifdef LOAD_PROFILE
+            SwingingDoor profile[PROFILE_CHANNELS];
+#endif
+#ifdef EXTREME_SAMPLES
+            Extremes extremes[CHANNELS];
+#endif
+#ifdef TIME_OF_USE
+            const TouCalendar* calendar = nullptr;              // Calendar routing samples to periods, or nullptr if none
+            TouAccumulator tou[TOU_PERIODS];
+#endif
+#ifdef FINE_HISTOGRAMS
+            FineHistogram fine[CHANNELS];
+            uint32_t rebinCount[CHANNELS] = {};                 // Number of bins to rebin each channel into; NOTE Not reset
+            double rebinBoundary[CHANNELS][FINE_REBIN_MAX];
 #endif
         };
 
         SampleAccumulator acc;                                  // Statically allocated meter sample accumulator
     };
+
+    bool parseTimeOfDay(const nlohmann::json& j, uint32_t& minutes);
 }
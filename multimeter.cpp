@@ -0,0 +1,276 @@
+#include <string.h>                                             // strncpy(), strncmp()
+#include <algorithm>
+#include <new>
+
+#include "multimeter.h"
+
+using namespace Meter;
+
+static_assert((MAX_METERS & (MAX_METERS - 1)) == 0, "MAX_METERS must be a power of two");
+
+// Return the 32-bit FNV-1a hash of the given string.
+static uint32_t hash(const char* s)
+{
+    uint32_t h = 2166136261u;
+    while (*s != '\0')
+    {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Construct a table that shards accumulation across at most the given number of workers, and at most one per core.  A single
+// core is left to accumulate inline, as a worker would only add the handoff to the same work.
+// NOTE hardware_concurrency() is looked up once here, as it may read /sys each time it is called.
+MeterTable::MeterTable(uint32_t maxWorkers_)
+{
+    uint32_t cores = std::thread::hardware_concurrency();
+    maxWorkers = cores < 2 ? 0 : std::min(std::min(maxWorkers_, cores), MAX_WORKERS);
+    workers = 0;
+    meters = 0;
+}
+
+MeterTable::~MeterTable()
+{
+    stopWorkers();
+}
+
+// Allocate a table with the cache line alignment of its Reports, which operator new does not provide before C++17.
+void* MeterTable::operator new(size_t size)
+{
+    void* p;
+    if (posix_memalign(&p, alignof(MeterTable), size) != 0)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+void MeterTable::operator delete(void* p)
+{
+    free(p);
+}
+
+// Accumulate the given sample into the report of the given meter, adding the meter to the table if it is new.
+// Returns false if the table is full, or if the sample could not be accumulated inline.
+bool MeterTable::accumulate(const char* meterId, const Sample& sample)
+{
+    int32_t slot = find(meterId);
+    if (slot < 0)
+        return false;
+
+    if (workers == 0)
+    {
+        if (meters <= SHARD_THRESHOLD || maxWorkers == 0)
+            return slots[slot].report.accumulate(sample);
+
+        startWorkers();
+    }
+
+    // Wake the worker only if it is idle; a busy worker takes everything queued meanwhile once it has finished its batch.
+    Shard& shard = shards[slot % workers];
+    std::unique_lock<std::mutex> lock(shard.mutex);
+    shard.drained.wait(lock, [&shard] { return shard.tail - shard.head < SHARD_QUEUE_DEPTH; });
+    bool idle = shard.head == shard.tail && !shard.busy;
+    Item& item = shard.queue[shard.tail % SHARD_QUEUE_DEPTH];
+    item.slot = slot;
+    item.sample = sample;
+    shard.tail++;
+    lock.unlock();
+    if (idle)
+        shard.ready.notify_one();
+
+    return true;
+}
+
+// Accumulate the given summation register readings into the report of the given meter, adding the meter to the table if it is
+// new.  Summations are read infrequently, so rather than being queued, they are accumulated once the meter's worker, if any, is
+// idle.
+// Returns false if the table is full, or if any reading could not be accumulated.
+bool MeterTable::accumulate(const char* meterId, const Summations& summations)
+{
+    int32_t slot = find(meterId);
+    if (slot < 0)
+        return false;
+
+    std::unique_lock<std::mutex> lock;
+    if (workers > 0)
+    {
+        Shard& shard = shards[slot % workers];
+        lock = std::unique_lock<std::mutex>(shard.mutex);
+        shard.drained.wait(lock, [&shard] { return shard.head == shard.tail && !shard.busy; });
+    }
+
+    return slots[slot].report.accumulate(summations);
+}
+
+// Summarise and reset the report of each meter that has accumulated samples, into at most maxSummaries summaries tagged with
+// their meter IDs.  Waits for the workers to finish accumulating any queued samples first.
+// Returns the number of summaries written.
+uint32_t MeterTable::summarise(SampleSummary* summaries, uint32_t maxSummaries)
+{
+    uint32_t n = 0;
+
+    for (uint32_t s = 0; s < MAX_METERS && n < maxSummaries; s++)
+    {
+        Slot& slot = slots[s];
+        if (!slot.used)
+            continue;
+
+        std::unique_lock<std::mutex> lock;
+        if (workers > 0)
+        {
+            Shard& shard = shards[s % workers];
+            lock = std::unique_lock<std::mutex>(shard.mutex);
+            shard.drained.wait(lock, [&shard] { return shard.head == shard.tail && !shard.busy; });
+        }
+
+        if (slot.report.count() == 0)
+            continue;
+
+        summaries[n].reset();
+        slot.report.summarise(summaries[n]);
+        strncpy(summaries[n].meterId, slot.id, METER_ID_LENGTH);
+        summaries[n].meterId[METER_ID_LENGTH] = '\0';
+        slot.report.reset();
+        n++;
+    }
+
+    return n;
+}
+
+// Reset the reports of all meters, keeping the meters themselves.
+void MeterTable::reset()
+{
+    for (uint32_t s = 0; s < MAX_METERS; s++)
+    {
+        std::unique_lock<std::mutex> lock;
+        if (workers > 0)
+        {
+            Shard& shard = shards[s % workers];
+            lock = std::unique_lock<std::mutex>(shard.mutex);
+            shard.drained.wait(lock, [&shard] { return shard.head == shard.tail && !shard.busy; });
+        }
+
+        slots[s].report.reset();
+    }
+}
+
+// Set the expected interval between each meter's samples, including meters not yet seen.
+void MeterTable::setExpectedPeriod(milliseconds period)
+{
+    for (uint32_t s = 0; s < MAX_METERS; s++)
+    {
+        std::unique_lock<std::mutex> lock;
+        if (workers > 0)
+        {
+            Shard& shard = shards[s % workers];
+            lock = std::unique_lock<std::mutex>(shard.mutex);
+            shard.drained.wait(lock, [&shard] { return shard.head == shard.tail && !shard.busy; });
+        }
+
+        slots[s].report.setExpectedPeriod(period);
+    }
+}
+
+#ifdef TIME_OF_USE
+// Route each meter's subsequent samples by the given time-of-use calendar, including meters not yet seen.
+void MeterTable::setCalendar(const TouCalendar* calendar)
+{
+    for (uint32_t s = 0; s < MAX_METERS; s++)
+    {
+        std::unique_lock<std::mutex> lock;
+        if (workers > 0)
+        {
+            Shard& shard = shards[s % workers];
+            lock = std::unique_lock<std::mutex>(shard.mutex);
+            shard.drained.wait(lock, [&shard] { return shard.head == shard.tail && !shard.busy; });
+        }
+
+        slots[s].report.setCalendar(calendar);
+    }
+}
+#endif
+
+// Return the table slot of the given meter, claiming a free slot if the meter is new, or -1 if the table is full.
+int32_t MeterTable::find(const char* meterId)
+{
+    uint32_t h = hash(meterId);
+    for (uint32_t probe = 0; probe < MAX_METERS; probe++)
+    {
+        uint32_t s = (h + probe) & (MAX_METERS - 1);
+        Slot& slot = slots[s];
+        if (!slot.used)
+        {
+            strncpy(slot.id, meterId, METER_ID_LENGTH);
+            slot.id[METER_ID_LENGTH] = '\0';
+            slot.used = true;
+            slot.report.reset();
+            meters++;
+            return s;
+        }
+
+        if (strncmp(slot.id, meterId, METER_ID_LENGTH) == 0)
+            return s;
+    }
+
+    return -1;
+}
+
+// Start maxWorkers worker threads.
+// NOTE Must only be called while no worker is running, so that no Report changes owner while samples are queued for it.
+void MeterTable::startWorkers()
+{
+    uint32_t n = maxWorkers;
+
+    for (uint32_t w = 0; w < n; w++)
+    {
+        Shard& shard = shards[w];
+        shard.head = shard.tail = 0;
+        shard.busy = shard.stop = false;
+        shard.thread = std::thread(&Shard::run, &shard, slots);
+    }
+    workers = n;
+}
+
+void MeterTable::stopWorkers()
+{
+    for (uint32_t w = 0; w < workers; w++)
+    {
+        Shard& shard = shards[w];
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.stop = true;
+        }
+        shard.ready.notify_one();
+        shard.thread.join();
+    }
+    workers = 0;
+}
+
+// Worker thread: accumulate queued samples into their meters' reports until stopped, taking everything queued at each wakeup
+// as one batch, so that the lock is taken once per batch rather than once per sample.
+void MeterTable::Shard::run(Slot* slots)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        ready.wait(lock, [this] { return head != tail || stop; });
+        if (head == tail)
+            return;
+
+        // The items up to end are not overwritten until head is advanced past them.
+        uint32_t end = tail;
+        busy = true;
+        lock.unlock();
+        for (uint32_t i = head; i != end; i++)
+        {
+            Item& item = queue[i % SHARD_QUEUE_DEPTH];
+            slots[item.slot].report.accumulate(item.sample);
+        }
+        lock.lock();
+        busy = false;
+        head = end;
+        drained.notify_one();
+    }
+}
@@ -0,0 +1,101 @@
+// Reports for several metering points keyed by meter ID, statically allocated memory version.
+//
+// Usage:
+//
+//    using namespace Meter;
+//    MeterTable table;
+//    SampleSummary summaries[MAX_METERS];
+//    while (...)
+//    {
+//        table.accumulate(meterId, sample);
+//    }
+//    uint32_t n = table.summarise(summaries, MAX_METERS);
+//
+// Meters are held in a flat, open-addressed table of Reports.  Up to SHARD_THRESHOLD meters, samples are accumulated inline.
+// Beyond that, accumulation is handed off to one worker thread per core, up to the maximum given (MAX_WORKERS by default), each
+// of which exclusively owns the Reports of every workers'th table slot, so no Report is shared between workers.  Samples are
+// still parsed by the calling thread, so only the accumulation is offloaded; to keep the handoff cheaper than the accumulation
+// it saves, an idle worker is woken only for the first sample queued, and each worker drains everything queued at each wakeup
+// as one batch.  bench/multimeter_scaling.cpp measures the throughput by number of workers.  accumulate() and summarise()
+// must be called from the same thread.
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+#include "meter.h"
+
+namespace Meter
+{
+    static constexpr uint32_t MAX_METERS = 32;                  // Table size; must be a power of two
+    static constexpr uint32_t MAX_WORKERS = 4;                  // Maximum number of ingest worker threads
+    static constexpr uint32_t SHARD_THRESHOLD = 8;              // Number of meters beyond which ingest is sharded across workers
+    static constexpr uint32_t SHARD_QUEUE_DEPTH = 64;           // Samples queued per worker before accumulate() blocks
+
+    class MeterTable
+    {
+    public:
+        MeterTable(uint32_t maxWorkers_ = MAX_WORKERS);
+        ~MeterTable();
+        static void* operator new(size_t size);
+        static void operator delete(void* p);
+        bool accumulate(const char* meterId, const Sample& sample);
+        bool accumulate(const char* meterId, const Summations& summations);
+        uint32_t summarise(SampleSummary* summaries, uint32_t maxSummaries);
+        uint32_t count() const { return meters; }
+        void reset();
+        void setExpectedPeriod(milliseconds period);
+#ifdef TIME_OF_USE
+        void setCalendar(const TouCalendar* calendar);
+#endif
+
+    private:
+        // A meter's ID and its Report.
+        struct Slot
+        {
+            Slot() { used = false; id[0] = '\0'; }
+
+            bool used;
+            char id[METER_ID_LENGTH + 1];
+            Report report;
+        };
+
+        // A sample destined for the given table slot.
+        struct Item
+        {
+            uint32_t slot;
+            Sample sample;
+        };
+
+        // A worker thread and the fixed size queue of samples it is to accumulate.
+        struct Shard
+        {
+            Shard() { head = tail = 0; busy = stop = false; }
+            void run(Slot* slots);
+
+            std::mutex mutex;
+            std::condition_variable ready;                      // Signalled when an item is queued, or on stop
+            std::condition_variable drained;                    // Signalled when the queue has space, or is empty and idle
+            Item queue[SHARD_QUEUE_DEPTH];
+            uint32_t head;                                      // Index of the next item to accumulate
+            uint32_t tail;                                      // Index of the next free item
+            bool busy;                                          // Worker is accumulating a batch of items outside the lock
+            bool stop;
+            std::thread thread;
+        };
+
+        int32_t find(const char* meterId);
+        void startWorkers();
+        void stopWorkers();
+
+        Slot slots[MAX_METERS];
+        Shard shards[MAX_WORKERS];
+        uint32_t maxWorkers;                                    // Worker threads to start, at most one per core; 0 for none
+        uint32_t workers;                                       // Number of running worker threads; 0 to accumulate inline
+        uint32_t meters;                                        // Number of slots in use
+    };
+}
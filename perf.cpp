@@ -0,0 +1,160 @@
+#include "perf.h"
+
+#ifdef PERF_COUNTERS
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>                                             // memset()
+
+#include <atomic>
+#include <chrono>
+
+using namespace std::chrono;
+using namespace Perf;
+
+static constexpr uint32_t STAGES = (uint32_t)Stage::COUNT;
+
+static const char* const stageName[STAGES]   = { "notify", "parse", "acc", "sum", "json" };
+static const char* const eventName[EVENTS]   = { "cyc", "ins", "bm", "cm" };
+static const uint64_t eventConfig[EVENTS]    = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                 PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES };
+
+static std::atomic<bool> isEnabled(false);
+static std::atomic<bool> eventAvailable[EVENTS];                // Set once any thread has opened the event
+
+// Per-stage totals, added to by whichever thread ran the stage.
+static std::atomic<uint64_t> calls[STAGES];
+static std::atomic<uint64_t> elapsedNs[STAGES];
+static std::atomic<uint64_t> totals[STAGES][EVENTS];
+
+// Counter file descriptors of the calling thread, opened on first use; -1 where an event is unavailable.
+struct Counters
+{
+    Counters() { for (int& f : fd) f = -1; opened = available = false; }
+    ~Counters() { for (int f : fd) if (f >= 0) close(f); }
+    bool open();
+    void read(uint64_t (&val)[EVENTS]) const;
+
+    int fd[EVENTS];
+    bool opened;
+    bool available;                                             // At least one event could be opened
+};
+
+static thread_local Counters counters;
+
+// Open a user space counter for each event on the calling thread, on any CPU.
+// Returns true if at least one event could be opened.
+bool Counters::open()
+{
+    opened = true;
+    for (uint32_t e = 0; e < EVENTS; e++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof attr;
+        attr.config = eventConfig[e];
+        attr.exclude_kernel = 1;                                // Permitted with perf_event_paranoid <= 2
+        attr.exclude_hv = 1;
+
+        fd[e] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd[e] >= 0)
+        {
+            eventAvailable[e] = true;
+            available = true;
+        }
+    }
+
+    return available;
+}
+
+// Read the current value of each open counter; unavailable events read as zero.
+void Counters::read(uint64_t (&val)[EVENTS]) const
+{
+    for (uint32_t e = 0; e < EVENTS; e++)
+    {
+        val[e] = 0;
+        if (fd[e] >= 0 && ::read(fd[e], &val[e], sizeof val[e]) != sizeof val[e])
+            val[e] = 0;
+    }
+}
+
+// Enable profiling, and open the calling thread's counters to probe their availability.
+// Returns true if at least one hardware event is available, false if only call counts and times will be collected.
+bool Perf::enable()
+{
+    isEnabled = true;
+    return counters.opened ? counters.available : counters.open();
+}
+
+bool Perf::enabled()
+{
+    return isEnabled;
+}
+
+// Create a JSON object encoding the totals of each stage that has run since the last reset.
+void Perf::json(ordered_json& j)
+{
+    j.clear();
+    for (uint32_t s = 0; s < STAGES; s++)
+    {
+        uint64_t n = calls[s];
+        if (n == 0)
+            continue;
+
+        ordered_json tmp;
+        tmp["n"] = n;
+        tmp["ns"] = (uint64_t)elapsedNs[s];
+        for (uint32_t e = 0; e < EVENTS; e++)
+        {
+            if (eventAvailable[e])
+                tmp[eventName[e]] = (uint64_t)totals[s][e];
+            else
+                tmp[eventName[e]] = nullptr;
+        }
+        j[stageName[s]] = tmp;
+    }
+}
+
+void Perf::reset()
+{
+    for (uint32_t s = 0; s < STAGES; s++)
+    {
+        calls[s] = 0;
+        elapsedNs[s] = 0;
+        for (uint32_t e = 0; e < EVENTS; e++)
+            totals[s][e] = 0;
+    }
+}
+
+Perf::Scope::Scope(Stage stage_)
+{
+    stage = stage_;
+    active = isEnabled;
+    if (!active)
+        return;
+
+    if (!counters.opened)
+        counters.open();
+    startNs = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    counters.read(start);
+}
+
+Perf::Scope::~Scope()
+{
+    if (!active)
+        return;
+
+    uint64_t end[EVENTS];
+    counters.read(end);
+    int64_t endNs = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+
+    uint32_t s = (uint32_t)stage;
+    for (uint32_t e = 0; e < EVENTS; e++)
+        totals[s][e] += end[e] - start[e];
+    elapsedNs[s] += endNs - startNs;
+    calls[s]++;
+}
+
+#endif
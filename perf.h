@@ -0,0 +1,76 @@
+// Hardware performance counter profiling of the app's hot stages, using Linux perf_event_open().
+//
+// Usage:
+//
+//    Perf::enable();
+//    {
+//        PERF_SCOPE(Perf::Stage::Accumulate);
+//        report.accumulate(sample);
+//    }
+//    ...
+//    ordered_json j;
+//    Perf::json(j);
+//    Perf::reset();
+//
+// Counters are opened per thread on first use, counting user space only.  Where the kernel or PMU does not provide an event
+// (e.g. perf_event_paranoid is too restrictive, or the core has no cache miss event), that event is reported as null and the
+// remaining events, call counts and wall-clock times are still collected.
+
+#pragma once
+
+#include <cstdint>
+
+#include "json.hpp"
+
+using namespace nlohmann;
+
+//#define PERF_COUNTERS                                           // Build with hardware performance counter profiling support
+
+namespace Perf
+{
+    // Instrumented stages of the app.
+    enum class Stage
+    {
+        Notify,                                                 // Notification content instance JSON parsing
+        Parse,                                                  // Extraction of a Sample from PowerQualityData
+        Accumulate,                                             // Report::accumulate()
+        Summarise,                                              // Report::summarise()
+        Json,                                                   // SampleSummary JSON encoding and serialisation
+        COUNT
+    };
+
+    // Hardware events counted for each stage.
+    enum Event
+    {
+        Cycles,
+        Instructions,
+        BranchMisses,
+        CacheMisses,
+        EVENTS
+    };
+
+    bool enable();
+    bool enabled();
+    void json(ordered_json& j);
+    void reset();
+
+    // Counts the hardware events occurring between construction and destruction, and adds them to the given stage's totals.
+    class Scope
+    {
+    public:
+        explicit Scope(Stage stage_);
+        ~Scope();
+
+    private:
+        Stage stage;
+        bool active;
+        uint64_t start[EVENTS];
+        int64_t startNs;
+    };
+}
+
+#ifdef PERF_COUNTERS
+#define PERF_SCOPE(stage)   Perf::Scope perfScope_(stage)
+#else
+#define PERF_SCOPE(stage)
+#endif
@@ -0,0 +1,163 @@
+#include <time.h>                                               // strptime(), mktime()
+
+#include "reorder.h"
+
+using namespace Meter;
+
+// Return the key of the given sample, i.e. its time quantised to the nearest multiple of the period.
+int64_t ReorderBuffer::keyOf(const Sample& sample) const
+{
+    return (duration_cast<milliseconds>(sample.ts.time_since_epoch()).count() + period / 2) / period;
+}
+
+// Accept the given sample, to be released in time order by pop().
+// Returns false if it is dropped as a duplicate or as late.
+bool ReorderBuffer::push(const Sample& sample)
+{
+    int64_t key = keyOf(sample);
+    if (slots[key % REORDER_SLOTS].key == key)
+    {
+        duplicates++;
+        return false;
+    }
+    if (key <= released && released - key <= (int64_t)(REORDER_SLOTS * REORDER_RESYNC))
+    {
+        late++;
+        return false;
+    }
+    if (key <= released)
+    {
+        resyncs++;
+        stepped = true;                                         // Leave it to pop() to restart once the samples held are released
+    }
+
+    // Its slot may still hold an older sample, so leave it to pop() to place once that has been released.
+    incoming = sample;
+    pending = true;
+    if (key > newest && !stepped)
+        newest = key;
+    if (released < 0)
+        released = key - 1;
+
+    return true;
+}
+
+// Release the next sample, if any, in time order.
+// Returns false if there is none to release yet.
+bool ReorderBuffer::pop(Sample& sample)
+{
+    while (released >= 0)
+    {
+        if (stepped)
+        {
+            // Release the samples held from before the clock stepped back, oldest first, then restart from the incoming sample.
+            Slot* oldest = nullptr;
+            for (Slot& s : slots)
+            {
+                if (s.held && (oldest == nullptr || s.key < oldest->key))
+                    oldest = &s;
+            }
+            if (oldest != nullptr)
+            {
+                oldest->held = false;
+                held--;
+                sample = oldest->sample;
+                return true;
+            }
+
+            int64_t key = keyOf(incoming);
+            reset();
+            pending = true;
+            released = key - 1;
+            newest = key;
+        }
+
+        if (pending)
+        {
+            int64_t key = keyOf(incoming);
+            Slot& slot = slots[key % REORDER_SLOTS];
+            if (!slot.held)
+            {
+                slot.key = key;
+                slot.held = true;
+                slot.sample = incoming;
+                pending = false;
+                held++;
+            }
+        }
+
+        Slot& slot = slots[(released + 1) % REORDER_SLOTS];
+        if (slot.held && slot.key == released + 1)
+        {
+            released++;
+            slot.held = false;
+            held--;
+            sample = slot.sample;
+            return true;
+        }
+        if (newest - released <= REORDER_SLOTS)
+            return false;                                       // Still within the window; wait for the missing sample
+
+        // Give up on the missing samples, up to the oldest held or the window behind the newest, whichever is first.
+        int64_t skip = newest - REORDER_SLOTS;
+        for (const Slot& s : slots)
+        {
+            if (s.held && s.key - 1 < skip)
+                skip = s.key - 1;
+        }
+        released = skip > released ? skip : released + 1;
+    }
+
+    return false;
+}
+
+// Set the expected period between samples, which the window is measured in, discarding any samples held.
+void ReorderBuffer::setPeriod(milliseconds period_)
+{
+    period = period_.count() > 0 ? period_.count() : 1;
+    reset();
+}
+
+void ReorderBuffer::reset()
+{
+    released = newest = -1;
+    held = 0;
+    pending = stepped = false;
+    for (Slot& slot : slots)
+    {
+        slot.key = -1;
+        slot.held = false;
+    }
+}
+
+// Parse a meter read time in local time, in the ISO 8601 basic (20240131T235959) or extended (2024-01-31T23:59:59) format,
+// with optional fractional seconds.
+// Returns false if it is not in either format.
+bool Meter::parseReadTime(const std::string& readTime, time_point<system_clock>& ts)
+{
+    struct tm tm = {};
+    const char* end = strptime(readTime.c_str(), "%Y%m%dT%H%M%S", &tm);
+    if (end == nullptr)
+    {
+        tm = {};
+        end = strptime(readTime.c_str(), "%Y-%m-%dT%H:%M:%S", &tm);
+        if (end == nullptr)
+            return false;
+    }
+
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+    if (t == (time_t)-1)
+        return false;
+
+    int64_t ms = 0;
+    if (*end == ',' || *end == '.')
+    {
+        int64_t scale = 100;
+        for (end++; *end >= '0' && *end <= '9'; end++, scale /= 10)
+            ms += (*end - '0') * scale;
+    }
+
+    ts = system_clock::from_time_t(t) + milliseconds(ms);
+    return true;
+}
@@ -0,0 +1,67 @@
+// Fixed size window that restores the time order of samples and drops duplicates, e.g. of meter reads retransmitted over CoAP.
+//
+// Usage:
+//
+//    using namespace Meter;
+//    ReorderBuffer buffer;
+//    buffer.setPeriod(milliseconds(1000));
+//    sample.ts = ...;                                            // Time of the reading
+//    buffer.push(sample);
+//    while (buffer.pop(sample))                                  // NOTE Must be drained after each push
+//        report.accumulate(sample);
+//
+// Each sample's time is quantised to a multiple of the expected period between samples, giving its key, and it is held in slot
+// key % REORDER_SLOTS.  A sample whose key is already held or released is a duplicate; one whose key precedes the last released
+// is late, and is dropped.  Samples are released as soon as all keys before them are released, so that samples arriving in order
+// pass straight through; otherwise the oldest are released, skipping the missing keys before them, once they fall out of the
+// window of REORDER_SLOTS periods behind the newest sample.  Pushing and popping thus each cost amortised O(1) per sample.
+// A sample more than REORDER_RESYNC windows behind the last released is taken to mean the meter's clock has stepped back (e.g.
+// the repeated hour at the end of daylight saving time, read times being local without an offset), rather than that it is
+// late: the samples held are released, and the buffer restarts from it.
+
+#pragma once
+
+#include <cstdint>
+
+#include "meter.h"
+
+namespace Meter
+{
+    static constexpr uint32_t REORDER_SLOTS = 8;                // Window length, in sample periods
+    static constexpr uint32_t REORDER_RESYNC = 4;               // Windows behind beyond which a sample restarts the read order
+
+    class ReorderBuffer
+    {
+    public:
+        ReorderBuffer() { period = 1000; duplicates = late = resyncs = 0; reset(); }
+        bool push(const Sample& sample);
+        bool pop(Sample& sample);
+        void setPeriod(milliseconds period_);
+        void reset();
+
+        uint32_t duplicates;                                    // Number of samples dropped as duplicates
+        uint32_t late;                                          // Number of samples dropped as too late to be released in order
+        uint32_t resyncs;                                       // Number of restarts of the read order, the clock stepping back
+
+    private:
+        struct Slot
+        {
+            int64_t key;                                        // Quantised time of the sample, or -1 if the slot was never used
+            bool held;                                          // The sample is awaiting release
+            Sample sample;
+        };
+
+        int64_t keyOf(const Sample& sample) const;
+
+        int64_t period;                                         // Expected time between samples, in milliseconds
+        int64_t released;                                       // Key of the last sample released, or -1 if none
+        int64_t newest;                                         // Greatest key pushed, or -1 if none
+        uint32_t held;                                          // Number of slots holding samples awaiting release
+        bool pending;                                           // The sample pushed last awaits a slot
+        bool stepped;                                           // It stepped back; the samples held are released before it
+        Sample incoming;
+        Slot slots[REORDER_SLOTS];
+    };
+
+    bool parseReadTime(const std::string& readTime, time_point<system_clock>& ts);
+}
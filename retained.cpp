@@ -0,0 +1,150 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cmath>                                                // std::isnan()
+
+#include "retained.h"
+
+using namespace Meter;
+
+// Return the given float as the nearest double with at most 3 decimal places, so as to encode it without float noise.
+static double tidy(float value)
+{
+    return nearbyint((double)value * 1000.0) / 1000.0;
+}
+
+void RetainedSummary::json(ordered_json& j) const
+{
+    j.clear();
+    if (meterId[0] != '\0')
+        j["m"] = meterId;
+    j["sq"] = sequence;
+    j["n"] = count;
+    j["ts"] = tsStart;
+    j["te"] = tsEnd;
+    if (!std::isnan(score))
+        j["z"] = tidy(score);
+
+    ordered_json avgs = json::array();
+    ordered_json mins = json::array();
+    ordered_json maxs = json::array();
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        avgs.push_back(tidy(avg[c]));                           // NOTE NaN is encoded as null
+        mins.push_back(tidy(min[c]));
+        maxs.push_back(tidy(max[c]));
+    }
+    j["avg"] = avgs;
+    j["min"] = mins;
+    j["max"] = maxs;
+}
+
+void RetainedSummary::set(uint32_t sequence_, const SampleSummary& sampleSummary)
+{
+    sequence = sequence_;
+    tsStart = duration_cast<seconds>(sampleSummary.tsStart.time_since_epoch()).count();
+    tsEnd = duration_cast<seconds>(sampleSummary.tsEnd.time_since_epoch()).count();
+    count = sampleSummary.count;
+    score = sampleSummary.score;
+    for (uint32_t c = 0; c < CHANNELS; c++)
+    {
+        const Summary& summary = sampleSummary.channel(c);
+        avg[c] = sampleSummary.count > 0 ? summary.avg : NAN;
+        min[c] = summary.min;
+        max[c] = summary.max;
+    }
+    memcpy(meterId, sampleSummary.meterId, sizeof meterId);
+}
+
+// Open the given file to persist the ring in, restoring any summaries already persisted there.
+// Returns false if the file cannot be opened, in which case the ring is held only in RAM.
+bool SummaryRing::open(const std::string& path)
+{
+    close();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+    if (fd < 0)
+        return false;
+
+    // Restore only a file of exactly the expected size, and only the slots that hold the summary their index implies.
+    if (pread(fd, ring, sizeof ring, 0) != (ssize_t)sizeof ring)
+    {
+        for (RetainedSummary& retained : ring)
+            retained.sequence = 0;
+        if (ftruncate(fd, 0) != 0 || pwrite(fd, ring, sizeof ring, 0) != (ssize_t)sizeof ring)
+        {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+    }
+
+    last = 0;
+    for (uint32_t i = 0; i < RETAINED_SUMMARIES; i++)
+    {
+        RetainedSummary& retained = ring[i];
+        if (retained.sequence % RETAINED_SUMMARIES != i || retained.meterId[METER_ID_LENGTH] != '\0')
+            retained.sequence = 0;
+        else if (retained.sequence > last)
+            last = retained.sequence;
+    }
+
+    return true;
+}
+
+void SummaryRing::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+// Retain the given sample summary, overwriting the oldest if the ring is full.
+// Returns the sequence number it is retained under.
+uint32_t SummaryRing::push(const SampleSummary& sampleSummary)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (++last == 0)                                            // Sequence number 0 is reserved for unused slots
+        last = 1;
+
+    uint32_t i = last % RETAINED_SUMMARIES;
+    ring[i].set(last, sampleSummary);
+    if (fd >= 0 && pwrite(fd, &ring[i], sizeof ring[i], i * sizeof ring[i]) != (ssize_t)sizeof ring[i])
+    {
+        ::close(fd);                                            // Carry on in RAM alone
+        fd = -1;
+    }
+
+    return last;
+}
+
+// Copy the summary with the given sequence number into retained.
+// Returns false if it has been overwritten, or has yet to be pushed.
+bool SummaryRing::get(uint32_t sequence, RetainedSummary& retained) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const RetainedSummary& slot = ring[sequence % RETAINED_SUMMARIES];
+    if (sequence == 0 || slot.sequence != sequence)
+        return false;
+
+    retained = slot;
+    return true;
+}
+
+// Return the sequence number of the oldest summary retained, or 0 if none.
+uint32_t SummaryRing::first() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (last == 0)
+        return 0;
+
+    uint32_t sequence = last > RETAINED_SUMMARIES ? last - RETAINED_SUMMARIES + 1 : 1;
+    while (sequence != last && ring[sequence % RETAINED_SUMMARIES].sequence != sequence)
+        sequence++;
+
+    return sequence;
+}
@@ -0,0 +1,68 @@
+// Fixed capacity ring of the most recent sample summaries sent, in compact form, for retransmission.
+//
+// Usage:
+//
+//    using namespace Meter;
+//    SummaryRing ring;
+//    ring.open("retained.dat");                                  // Optional; restores and persists the ring
+//    sampleSummary.sequence = ring.push(sampleSummary);
+//    ...
+//    RetainedSummary retained;
+//    if (ring.get(sequence, retained))
+//        ... retransmit it ...
+//
+// Each summary pushed is given the next sequence number, and overwrites the summary RETAINED_SUMMARIES before it, so that the
+// summary with a given sequence number is found directly at index sequence % RETAINED_SUMMARIES.  Only the average, minimum and
+// maximum of each channel are retained, as floats, taking sizeof (RetainedSummary) = 244 bytes each, so the default capacity of
+// a week of hourly summaries takes 40 KiB of RAM, and as much again on disk if persisted.
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "meter.h"
+
+namespace Meter
+{
+    static constexpr uint32_t RETAINED_SUMMARIES = 168;         // Capacity of the ring, e.g. a week of hourly summaries
+
+    // Compact form of a SampleSummary.
+    struct RetainedSummary
+    {
+        RetainedSummary() { sequence = 0; }
+        void json(ordered_json& j) const;
+        void set(uint32_t sequence_, const SampleSummary& sampleSummary);
+
+        uint32_t sequence;                                      // Sequence number, or 0 if the slot is unused
+        uint32_t tsStart;                                       // Seconds since the epoch
+        uint32_t tsEnd;
+        uint32_t count;
+        float score;
+        float avg[CHANNELS];
+        float min[CHANNELS];
+        float max[CHANNELS];
+        char meterId[METER_ID_LENGTH + 1];
+    };
+
+    class SummaryRing
+    {
+    public:
+        SummaryRing() { fd = -1; last = 0; }
+        ~SummaryRing() { close(); }
+        bool open(const std::string& path);
+        void close();
+        uint32_t push(const SampleSummary& sampleSummary);
+        bool get(uint32_t sequence, RetainedSummary& retained) const;
+        uint32_t first() const;
+        uint32_t lastSequence() const { std::lock_guard<std::mutex> lock(mutex); return last; }
+        bool persistent() const { std::lock_guard<std::mutex> lock(mutex); return fd >= 0; }
+
+    private:
+        mutable std::mutex mutex;                               // Guards the ring, which is pushed and read from different threads
+        int fd;                                                 // Persistent copy of the ring, or -1 if none
+        uint32_t last;                                          // Sequence number of the most recent summary, or 0 if none
+        RetainedSummary ring[RETAINED_SUMMARIES];
+    };
+}
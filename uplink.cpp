@@ -0,0 +1,288 @@
+#include <time.h>                                               // localtime_r(), mktime()
+
+#include <cmath>                                                // std::isfinite(), HUGE_VAL
+
+#include "uplink.h"
+#include "meter.h"                                               // parseTimeOfDay()
+
+using namespace Meter;
+
+static const char* const laneName[LANES] = { "u", "r", "b" };
+
+// Return the lane whose upload is to be sent next, given which lanes have uploads waiting, or -1 if none do.
+int UploadScheduler::next(const bool (&waiting)[LANES])
+{
+    for (uint32_t lane = 0; lane < LANES; lane++)
+    {
+        if (!waiting[lane])
+            continue;
+
+        bool lowerWaiting = false;
+        for (uint32_t l = lane + 1; l < LANES; l++)
+            lowerWaiting = lowerWaiting || waiting[l];
+
+        if (!lowerWaiting)
+        {
+            turns[lane] = 0;
+            return lane;
+        }
+        if (weight[lane] > 0 && turns[lane] >= weight[lane])
+        {
+            turns[lane] = 0;                                    // Yield this turn to the next lower lane waiting
+            continue;
+        }
+        turns[lane]++;
+        return lane;
+    }
+
+    return -1;
+}
+
+// Record the completion of a request sent from the given lane, the given time after its upload was queued.
+void UploadScheduler::sent(uint32_t lane, milliseconds latency, bool success)
+{
+    LaneStats& s = stats[lane];
+    uint32_t ms = latency.count() > 0 ? (uint32_t)latency.count() : 0;
+    s.count++;
+    s.failures += !success;
+    s.latencyTotal += ms;
+    if (ms > s.latencyMax)
+        s.latencyMax = ms;
+}
+
+// Return the latencies of each lane with requests sent since the last reset, in milliseconds, as
+// {<lane>: {"n": <requests>, "f": <failures>, "avg": <mean>, "max": <maximum>}, ...}.
+void UploadScheduler::json(ordered_json& j) const
+{
+    j = ordered_json::object();
+    for (uint32_t lane = 0; lane < LANES; lane++)
+    {
+        const LaneStats& s = stats[lane];
+        if (s.count > 0)
+            j[laneName[lane]] = { { "n", s.count }, { "f", s.failures }, { "avg", s.latencyTotal / s.count },
+                                  { "max", s.latencyMax } };
+    }
+}
+
+void UploadScheduler::reset()
+{
+    for (LaneStats& s : stats)
+    {
+        s.count = s.failures = s.latencyMax = 0;
+        s.latencyTotal = 0;
+    }
+}
+
+// Set the daily and monthly budgets, in bytes, 0 being unlimited, refilling the bucket.
+void UplinkBudget::setBudget(uint64_t daily_, uint64_t monthly_)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    daily = daily_;
+    monthly = monthly_;
+    tokens = HUGE_VAL;                                          // Capped to the allowance on the next refill
+}
+
+// Set the off-peak windows from a JSON array such as [{"from": "23:00", "to": "06:00"}, ...], in local time, or [] for none.
+// A window ending at or before its start time runs on past midnight.
+// Returns false, leaving the windows unchanged, if the array is malformed or too long.
+bool UplinkBudget::setOffPeak(const nlohmann::json& j)
+{
+    if (!j.is_array() || j.size() > OFF_PEAK_WINDOWS)
+        return false;
+
+    uint32_t from[OFF_PEAK_WINDOWS], to[OFF_PEAK_WINDOWS];
+    for (uint32_t w = 0; w < j.size(); w++)
+    {
+        const nlohmann::json& window = j[w];
+        if (!window.is_object() || window.find("from") == window.end() || !parseTimeOfDay(window.at("from"), from[w])
+            || window.find("to") == window.end() || !parseTimeOfDay(window.at("to"), to[w]))
+            return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    windows = j.size();
+    for (uint32_t w = 0; w < windows; w++)
+    {
+        windowFrom[w] = from[w];
+        windowTo[w] = to[w];
+    }
+
+    return true;
+}
+
+// Take the given number of bytes sent from the bucket and the month's budget.
+void UplinkBudget::spend(size_t bytes, time_point<system_clock> now)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    refill(now);
+    tokens -= bytes;
+    monthUsed += bytes;
+}
+
+// Return the step down in report detail due, as a BudgetLevel.
+uint32_t UplinkBudget::level(time_point<system_clock> now)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    refill(now);
+    return levelOf();
+}
+
+// Return whether an upload in the given lane may be sent now.
+bool UplinkBudget::allows(uint32_t lane, time_point<system_clock> now)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    refill(now);
+    uint32_t l = levelOf();
+    if (lane == LANE_URGENT)
+        return true;
+    if (lane == LANE_REPORT)
+        return l < LEVEL_EXHAUSTED;
+
+    return l < LEVEL_COARSE && offPeak(now);
+}
+
+// Create a JSON object encoding the level, the bytes left in the bucket and the bytes sent this month.
+void UplinkBudget::json(ordered_json& j, time_point<system_clock> now)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    refill(now);
+    j = { { "lv", levelOf() }, { "tk", limited() ? (int64_t)tokens : 0 }, { "mu", monthUsed } };
+}
+
+void UplinkBudget::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    allowance = tokens = HUGE_VAL;
+    refilled = system_clock::from_time_t(0);
+    month = -1;
+    monthUsed = 0;
+}
+
+// Start a new month's usage if the local calendar month has changed, work out the allowance, and add the allowance for the time
+// since the last refill to the bucket, up to the allowance.
+// NOTE Call with the mutex held.
+void UplinkBudget::refill(time_point<system_clock> now)
+{
+    time_t t = system_clock::to_time_t(now);
+    struct tm tm;
+    if (localtime_r(&t, &tm) == nullptr)
+        return;
+
+    if (tm.tm_year * 12 + tm.tm_mon != month)
+    {
+        month = tm.tm_year * 12 + tm.tm_mon;
+        monthUsed = 0;
+    }
+
+    allowance = daily > 0 ? (double)daily : HUGE_VAL;
+    if (monthly > 0)
+    {
+        tm.tm_mon++;                                            // Normalised by mktime()
+        tm.tm_mday = 1;
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+        tm.tm_isdst = -1;
+        double days = fmax(difftime(mktime(&tm), t) / 86400.0, 1.0);    // Allowing the rest on the last day
+        double remaining = monthUsed < monthly ? (double)(monthly - monthUsed) : 0.0;
+        allowance = fmin(allowance, remaining / days);
+    }
+
+    double elapsed = refilled.time_since_epoch().count() > 0 ? duration<double>(now - refilled).count() : 0.0;
+    if (elapsed > 0.0 && std::isfinite(allowance))
+        tokens += allowance * elapsed / 86400.0;
+    tokens = fmin(tokens, allowance);
+    refilled = now;
+}
+
+// NOTE Call with the mutex held, after refill().
+uint32_t UplinkBudget::levelOf() const
+{
+    if (!limited())
+        return LEVEL_NORMAL;
+    if (tokens <= 0.0 || (monthly > 0 && monthUsed >= monthly))
+        return LEVEL_EXHAUSTED;
+    if (tokens < BUDGET_COARSE * allowance)
+        return LEVEL_COARSE;
+    if (tokens < BUDGET_BRIEF * allowance)
+        return LEVEL_BRIEF;
+
+    return LEVEL_NORMAL;
+}
+
+// Return whether the given time falls in an off-peak window, or true if there are none.
+// NOTE Call with the mutex held.
+bool UplinkBudget::offPeak(time_point<system_clock> now) const
+{
+    if (windows == 0)
+        return true;
+
+    time_t t = system_clock::to_time_t(now);
+    struct tm tm;
+    if (localtime_r(&t, &tm) == nullptr)
+        return true;
+
+    uint32_t minute = tm.tm_hour * 60 + tm.tm_min;
+    for (uint32_t w = 0; w < windows; w++)
+    {
+        bool within = windowTo[w] > windowFrom[w] ? minute >= windowFrom[w] && minute < windowTo[w]
+                                                  : minute >= windowFrom[w] || minute < windowTo[w];
+        if (within)
+            return true;
+    }
+
+    return false;
+}
+
+// Count the given number of summaries as delivered.
+void Backpressure::delivered(uint32_t summaries)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    deliveredCount += summaries;
+}
+
+// Update the delivery rate and the factor to lengthen the report period of the given length by, given the number of summaries
+// still queued, and return the factor.
+uint32_t Backpressure::update(size_t queued, milliseconds period, time_point<steady_clock> now)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (updated.time_since_epoch().count() > 0 && now > updated)
+        rate = deliveredCount / duration<double>(now - updated).count();
+    deliveredCount = 0;
+    updated = now;
+    backlog = queued;
+
+    if (queued == 0)
+    {
+        if (factor > 1)
+            factor /= 2;
+    }
+    else if (rate <= 0.0 || queued / rate > duration<double>(period).count() * factor * BACKPRESSURE_PERIODS)
+    {
+        if (factor < BACKPRESSURE_FACTOR_MAX)
+            factor *= 2;
+    }
+
+    return factor;
+}
+
+uint32_t Backpressure::periodFactor()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return factor;
+}
+
+// Create a JSON object encoding the factor, the backlog, and the delivery rate in summaries per hour, as of the last update.
+void Backpressure::json(ordered_json& j)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    j = { { "f", factor }, { "q", backlog }, { "r", (uint32_t)(rate * 3600.0 + 0.5) } };
+}
+
+void Backpressure::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    factor = 1;
+    deliveredCount = 0;
+    rate = 0.0;
+    backlog = 0;
+    updated = time_point<steady_clock>();
+}
@@ -0,0 +1,172 @@
+// Scheduling of uploads between priority lanes sharing the single uplink, with per-lane latency metrics, governing of the
+// uplink's data usage against a byte budget, and backpressure from the upload backlog to the reporting granularity.
+//
+// Usage:
+//
+//    using namespace Meter;
+//    UploadScheduler scheduler;
+//    bool waiting[LANES] = { !urgentQueue.empty(), !reportQueue.empty(), bulkPending };
+//    int lane = scheduler.next(waiting);
+//    if (lane >= 0)
+//    {
+//        ... send the oldest upload of the lane, queued at time queued ...
+//        scheduler.sent(lane, steady_clock::now() - queued, success);
+//    }
+//    ...
+//    ordered_json j;
+//    scheduler.json(j);
+//    scheduler.reset();
+//
+//    UplinkBudget budget;
+//    budget.setBudget(1000000, 20000000);                        // Bytes per day and per month
+//    budget.setOffPeak(offPeakWindows);
+//    if (budget.allows(lane, system_clock::now()))
+//        ... send it ...
+//    budget.spend(bytes, system_clock::now());
+//
+//    Backpressure backpressure;
+//    backpressure.delivered(batch.size());                       // After each successful upload
+//    ...
+//    uint32_t factor = backpressure.update(queued, reportPeriod, steady_clock::now());     // At each report time
+//
+// Uploads are sent one request at a time, so a lane preempts those below it only at request boundaries; a long stream, such as
+// a history query answered in parts, is thus interleaved with more urgent uploads rather than holding them up.  Each turn goes
+// to the highest priority lane with an upload waiting, unless that lane has a non-zero weight and has already had that many
+// consecutive turns while a lower lane was waiting, in which case it yields one turn to the next lower lane waiting.  A weight
+// of 0 gives a lane strict priority over the lanes below it.  Latency is measured from the time an upload was queued to the
+// time its request completed.
+// NOTE Not thread safe; intended to be used only by the thread sending the uploads.
+//
+// The budget governor is a token bucket, holding up to a day's allowance of bytes and refilled continuously at that
+// allowance per day.  The allowance is the daily budget, or if less, the monthly budget remaining spread evenly over the days
+// remaining in the local calendar month.  Every byte sent is taken from the bucket, which may go into debt, since an upload's
+// size is only known once it has been encoded.  As the bucket empties, the report detail is stepped down: below BUDGET_BRIEF
+// of the allowance, summaries are sent brief, without histograms; below BUDGET_COARSE, the report period is also lengthened
+// BUDGET_COARSE_FACTOR times, and bulk uploads are held back; once empty, or the monthly budget is spent, only urgent uploads
+// are sent.  Bulk uploads are further deferred to the configured off-peak windows of the local day, if any.  The usage this
+// month is not persisted across restarts, so is undercounted after one.
+//
+// The backpressure controller is updated at each report time with the number of summaries still queued, and measures the rate
+// they have been delivered at since the last update.  If the backlog would take longer than BACKPRESSURE_PERIODS report periods
+// to drain at that rate (or forever, if nothing was delivered), the factor to lengthen the report period by is doubled, up to
+// BACKPRESSURE_FACTOR_MAX; each time the backlog is found drained, the factor is halved, restoring the report period in steps.
+// Separately, the caller merges queued summaries once more than BACKLOG_MERGE are waiting, bounding the memory they take.
+
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+
+#include "json.hpp"
+
+using namespace std::chrono;
+using namespace nlohmann;
+
+namespace Meter
+{
+    // Upload lanes, in priority order.
+    enum Lane : uint32_t
+    {
+        LANE_URGENT,                                            // Alarms and events, i.e. anomalous summaries
+        LANE_REPORT,                                            // Current report summaries
+        LANE_BULK,                                              // Backfill: history query answers and resent summaries
+        LANES
+    };
+
+    static constexpr uint32_t LANE_WEIGHTS[LANES] = { 0, 4, 0 }; // Default consecutive turns before yielding one; 0 for strict
+    static constexpr uint32_t UPLINK_REQUEST_OVERHEAD = 200;    // Estimated bytes of CoAP, DTLS and oneM2M headers per request
+    static constexpr double BUDGET_BRIEF = 0.5;                 // Fraction of the allowance below which summaries are brief
+    static constexpr double BUDGET_COARSE = 0.2;                // Fraction below which the report period is also lengthened
+    static constexpr uint32_t BUDGET_COARSE_FACTOR = 4;         // Factor to lengthen the report period by
+    static constexpr uint32_t OFF_PEAK_WINDOWS = 4;             // Maximum number of off-peak windows
+    static constexpr uint32_t BACKLOG_MERGE = 48;               // Queued summaries above which they are merged to coarser ones
+    static constexpr uint32_t BACKPRESSURE_PERIODS = 2;         // Periods of backlog beyond which the period is lengthened
+    static constexpr uint32_t BACKPRESSURE_FACTOR_MAX = 8;      // Maximum factor to lengthen the report period by
+
+    // Steps down in report detail, as the uplink budget runs down.
+    enum BudgetLevel : uint32_t
+    {
+        LEVEL_NORMAL,
+        LEVEL_BRIEF,                                            // Summaries sent brief
+        LEVEL_COARSE,                                           // Also the report period lengthened, and bulk uploads held back
+        LEVEL_EXHAUSTED                                         // Only urgent uploads sent
+    };
+
+    class UploadScheduler
+    {
+    public:
+        UploadScheduler() { for (uint32_t l = 0; l < LANES; l++) { weight[l] = LANE_WEIGHTS[l]; turns[l] = 0; } reset(); }
+        int next(const bool (&waiting)[LANES]);
+        void sent(uint32_t lane, milliseconds latency, bool success);
+        void setWeight(uint32_t lane, uint32_t weight_) { weight[lane] = weight_; turns[lane] = 0; }
+        void json(ordered_json& j) const;
+        void reset();
+        uint32_t count() const { return stats[LANE_URGENT].count + stats[LANE_REPORT].count + stats[LANE_BULK].count; }
+
+    private:
+        // Latencies of a lane's uploads since the last reset.
+        struct LaneStats
+        {
+            uint32_t count;                                     // Number of requests sent, whether successfully or not
+            uint32_t failures;
+            uint64_t latencyTotal;                              // In milliseconds
+            uint32_t latencyMax;                                // In milliseconds
+        };
+
+        uint32_t weight[LANES];
+        uint32_t turns[LANES];                                  // Consecutive turns taken while a lower lane was waiting
+        LaneStats stats[LANES];
+    };
+
+    class UplinkBudget
+    {
+    public:
+        UplinkBudget() { daily = monthly = 0; windows = 0; reset(); }
+        void setBudget(uint64_t daily_, uint64_t monthly_);
+        bool setOffPeak(const nlohmann::json& j);
+        void spend(size_t bytes, time_point<system_clock> now);
+        uint32_t level(time_point<system_clock> now);
+        bool allows(uint32_t lane, time_point<system_clock> now);
+        uint32_t periodFactor(time_point<system_clock> now) { return level(now) >= LEVEL_COARSE ? BUDGET_COARSE_FACTOR : 1; }
+        void json(ordered_json& j, time_point<system_clock> now);
+        bool limited() const { return daily > 0 || monthly > 0; }
+        void reset();
+
+    private:
+        void refill(time_point<system_clock> now);
+        uint32_t levelOf() const;
+        bool offPeak(time_point<system_clock> now) const;
+
+        std::mutex mutex;                                       // Guards the state, spent from any thread sending requests
+        uint64_t daily;                                         // Bytes per day, or 0 if unlimited
+        uint64_t monthly;                                       // Bytes per calendar month, or 0 if unlimited
+        double allowance;                                       // Bytes per day currently allowed, and the bucket's capacity
+        double tokens;                                          // Bytes left in the bucket; negative if in debt
+        time_point<system_clock> refilled;                      // Time the bucket was last refilled, or the epoch if never
+        int32_t month;                                          // Local calendar month of monthUsed, as year * 12 + month
+        uint64_t monthUsed;                                     // Bytes sent this month
+        uint32_t windows;                                       // Number of off-peak windows; 0 if bulk uploads may go any time
+        uint32_t windowFrom[OFF_PEAK_WINDOWS];                  // Start of each window, in minutes since local midnight
+        uint32_t windowTo[OFF_PEAK_WINDOWS];                    // End of each window; at or before the start if past midnight
+    };
+
+    class Backpressure
+    {
+    public:
+        Backpressure() { reset(); }
+        void delivered(uint32_t summaries);
+        uint32_t update(size_t queued, milliseconds period, time_point<steady_clock> now);
+        uint32_t periodFactor();
+        void json(ordered_json& j);
+        void reset();
+
+    private:
+        std::mutex mutex;                                       // Guards the state, updated and delivered on different threads
+        uint32_t factor;                                        // Factor the report period is lengthened by
+        uint32_t deliveredCount;                                // Summaries delivered since the last update
+        double rate;                                            // Summaries delivered per second, as of the last update
+        size_t backlog;                                         // Summaries queued, as of the last update
+        time_point<steady_clock> updated;                       // Time of the last update, or the epoch if none
+    };
+}